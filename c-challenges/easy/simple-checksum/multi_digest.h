@@ -0,0 +1,287 @@
+/*****************************************************************************
+ * Fused multi-digest engine
+ *
+ * Computes any selection of the byte sum, simple_checksum, xor_checksum,
+ * fletcher16 and CRC-32 in one pass over the data. The input is walked in
+ * MULTI_DIGEST_BLOCK sized pieces small enough to stay in L1, and every
+ * selected digest runs over a piece before moving on - so each cache line
+ * comes from memory once however many digests are asked for.
+ *
+ * The per-piece work goes through multi_digest_kernels. The header's own
+ * kernels are portable loops; a program with faster ones (SIMD sums,
+ * PCLMUL CRC) points multi_digest_kernels at them, before any thread starts
+ * hashing. Fused is only worth it with kernels that fast - the
+ * plain loops are slower than one fast kernel per pass.
+ *
+ * Digests of neighbouring pieces of data can be merged with
+ * multi_digest_combine, which is how mt_file_hasher.c gives each worker its
+ * own slice of the file.
+ *
+ * Shared by simple_checksum.c and mt_file_hasher.c - each of those is a
+ * single .c file, so this header holds the definitions too. Everything is
+ * static, so a second .c file linked into the same program can include it
+ * as well - it just gets its own copy of the tables and of
+ * multi_digest_kernels.
+ *****************************************************************************/
+
+#ifndef MULTI_DIGEST_H
+#define MULTI_DIGEST_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+// which digests to compute - OR these together
+#define DIGEST_SUM (1u << 0) // ... 64-bit sum of all bytes (the hasher's hash)
+#define DIGEST_SIMPLE (1u << 1) // ... simple_checksum: the sum's lowest 8 bits
+#define DIGEST_XOR (1u << 2) // ... xor_checksum
+#define DIGEST_FLETCHER16 (1u << 3) // ... fletcher16
+#define DIGEST_CRC32 (1u << 4) // ... CRC-32 (IEEE 802.3, as used by zlib and PNG)
+#define DIGEST_ALL (DIGEST_SUM | DIGEST_SIMPLE | DIGEST_XOR | DIGEST_FLETCHER16 | DIGEST_CRC32)
+
+// bytes handled per step - fits in L1, and is below the 5802 bytes after which
+// fletcher16's deferred sums could overflow 32 bits
+#define MULTI_DIGEST_BLOCK 4096
+
+// reflected CRC-32 polynomial
+#define CRC32_POLY 0xEDB88320u
+
+typedef struct {
+    unsigned selected; // ... DIGEST_* flags
+    uint64_t sum; // ... DIGEST_SUM and DIGEST_SIMPLE
+    uint8_t xor_value;
+    uint32_t fletcher_one; // ... always reduced mod 255 between blocks
+    uint32_t fletcher_two;
+    uint32_t crc; // ... pre-inverted, multi_digest_crc32 does the final xor
+} MultiDigest;
+
+// the kernels the engine runs on each block
+typedef struct {
+    uint64_t (*sum)(const uint8_t *data, size_t len); // ... sum of the bytes
+    uint8_t (*xor_fn)(const uint8_t *data, size_t len); // ... xor of the bytes
+    // adds the bytes to fletcher16's two sums without reducing - len is at
+    // most MULTI_DIGEST_BLOCK
+    void (*fletcher)(uint64_t *one, uint64_t *two, const uint8_t *data, size_t len);
+    // CRC-32 on the pre-inverted state, no final xor
+    uint32_t (*crc32)(uint32_t crc, const uint8_t *data, size_t len);
+} MultiDigestKernels;
+
+// crc32_table[0] is the usual byte table, crc32_table[k] moves a byte k more
+// positions through the register - slice-by-8 looks up 8 bytes at once
+static uint32_t crc32_table[8][256];
+static int crc32_table_state = 0; // ... 0 = not built, 1 = being built, 2 = ready
+
+// builds the CRC tables on first use. safe to call from many
+// threads - one builds it while the others wait
+static inline void crc32_init_table(void) {
+    if (__atomic_load_n(&crc32_table_state, __ATOMIC_ACQUIRE) == 2) {
+        return;
+    }
+
+    int expected = 0;
+    if (__atomic_compare_exchange_n(&crc32_table_state, &expected, 1, 0,
+                                    __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) {
+                c = c & 1 ? (c >> 1) ^ CRC32_POLY : c >> 1;
+            }
+            crc32_table[0][i] = c;
+        }
+        for (uint32_t i = 0; i < 256; i++) {
+            for (int k = 1; k < 8; k++) {
+                uint32_t c = crc32_table[k - 1][i];
+                crc32_table[k][i] = crc32_table[0][c & 0xFF] ^ (c >> 8);
+            }
+        }
+        __atomic_store_n(&crc32_table_state, 2, __ATOMIC_RELEASE);
+        return;
+    }
+
+    while (__atomic_load_n(&crc32_table_state, __ATOMIC_ACQUIRE) != 2) {
+        // someone else is building it
+    }
+}
+
+static inline void multi_digest_init(MultiDigest *md, unsigned selected) {
+    md->selected = selected;
+    md->sum = 0;
+    md->xor_value = 0;
+    md->fletcher_one = 0;
+    md->fletcher_two = 0;
+    md->crc = 0xFFFFFFFFu;
+
+    if (selected & DIGEST_CRC32) {
+        crc32_init_table();
+    }
+}
+
+static inline uint64_t multi_digest_sum_portable(const uint8_t *data, size_t len) {
+    uint64_t sum = 0;
+    for (size_t i = 0; i < len; i++) {
+        sum += data[i];
+    }
+    return sum;
+}
+
+// xor 8 bytes at a time, then fold the word down to one byte
+static inline uint8_t multi_digest_xor_portable(const uint8_t *data, size_t len) {
+    uint64_t word_xor = 0;
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, sizeof(word));
+        word_xor ^= word;
+    }
+    word_xor ^= word_xor >> 32;
+    word_xor ^= word_xor >> 16;
+    word_xor ^= word_xor >> 8;
+
+    uint8_t x = (uint8_t)word_xor;
+    for (; i < len; i++) {
+        x ^= data[i];
+    }
+    return x;
+}
+
+static inline void multi_digest_fletcher_portable(uint64_t *one, uint64_t *two,
+                                                  const uint8_t *data, size_t len) {
+    uint32_t a = (uint32_t)*one;
+    uint32_t b = (uint32_t)*two;
+    for (size_t i = 0; i < len; i++) {
+        a += data[i];
+        b += a;
+    }
+    *one = a;
+    *two = b;
+}
+
+// slice-by-8, assumes a little-endian host
+static inline uint32_t multi_digest_crc32_portable(uint32_t crc, const uint8_t *data, size_t len) {
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint32_t lo;
+        uint32_t hi;
+        memcpy(&lo, data + i, sizeof(lo));
+        memcpy(&hi, data + i + 4, sizeof(hi));
+        lo ^= crc;
+        crc = crc32_table[7][lo & 0xFF] ^ crc32_table[6][(lo >> 8) & 0xFF] ^
+              crc32_table[5][(lo >> 16) & 0xFF] ^ crc32_table[4][lo >> 24] ^
+              crc32_table[3][hi & 0xFF] ^ crc32_table[2][(hi >> 8) & 0xFF] ^
+              crc32_table[1][(hi >> 16) & 0xFF] ^ crc32_table[0][hi >> 24];
+    }
+    for (; i < len; i++) {
+        crc = crc32_table[0][(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+static const MultiDigestKernels multi_digest_portable_kernels = {
+    multi_digest_sum_portable,
+    multi_digest_xor_portable,
+    multi_digest_fletcher_portable,
+    multi_digest_crc32_portable
+};
+
+// set before threads start - the engine only ever reads it
+static const MultiDigestKernels *multi_digest_kernels = &multi_digest_portable_kernels;
+
+// one L1-sized block - every selected digest reads the same cached bytes
+static inline void multi_digest_block(MultiDigest *md, const uint8_t *data, size_t len) {
+    const MultiDigestKernels *k = multi_digest_kernels;
+
+    if (md->selected & (DIGEST_SUM | DIGEST_SIMPLE)) {
+        md->sum += k->sum(data, len);
+    }
+
+    if (md->selected & DIGEST_XOR) {
+        md->xor_value ^= k->xor_fn(data, len);
+    }
+
+    if (md->selected & DIGEST_FLETCHER16) {
+        // same sums as fletcher16, but reduced once per block instead of per byte
+        uint64_t one = md->fletcher_one;
+        uint64_t two = md->fletcher_two;
+        k->fletcher(&one, &two, data, len);
+        md->fletcher_one = one % 255;
+        md->fletcher_two = two % 255;
+    }
+
+    if (md->selected & DIGEST_CRC32) {
+        md->crc = k->crc32(md->crc, data, len);
+    }
+}
+
+static inline void multi_digest_update(MultiDigest *md, const uint8_t *data, size_t len) {
+    while (len > 0) {
+        size_t n = len < MULTI_DIGEST_BLOCK ? len : MULTI_DIGEST_BLOCK;
+        multi_digest_block(md, data, n);
+        data += n;
+        len -= n;
+    }
+}
+
+static inline uint8_t multi_digest_simple(const MultiDigest *md) {
+    return (uint8_t)md->sum;
+}
+
+static inline uint16_t multi_digest_fletcher16(const MultiDigest *md) {
+    return (uint16_t)((md->fletcher_two << 8) | md->fletcher_one);
+}
+
+static inline uint32_t multi_digest_crc32(const MultiDigest *md) {
+    return md->crc ^ 0xFFFFFFFFu;
+}
+
+// a * b modulo the CRC polynomial, in the reflected bit order the table uses
+// (bit 31 is x^0)
+static inline uint32_t crc32_multmodp(uint32_t a, uint32_t b) {
+    uint32_t m = 1u << 31;
+    uint32_t p = 0;
+
+    while (m != 0) {
+        if (a & m) {
+            p ^= b;
+        }
+        m >>= 1;
+        b = b & 1 ? (b >> 1) ^ CRC32_POLY : b >> 1;
+    }
+
+    return p;
+}
+
+// x^(8 * bytes) modulo the CRC polynomial, by repeated squaring
+static inline uint32_t crc32_x8nmodp(uint64_t bytes) {
+    uint32_t p = 1u << 31; // ... x^0
+    uint32_t square = 1u << 23; // ... x^8, one byte
+
+    while (bytes != 0) {
+        if (bytes & 1) {
+            p = crc32_multmodp(square, p);
+        }
+        square = crc32_multmodp(square, square);
+        bytes >>= 1;
+    }
+
+    return p;
+}
+
+// merges the digest of the `len_b` bytes that follow `a`'s data into `a`, so
+// a becomes the digest of both pieces back to back
+static inline void multi_digest_combine(MultiDigest *a, const MultiDigest *b, uint64_t len_b) {
+    a->sum += b->sum;
+    a->xor_value ^= b->xor_value;
+
+    // every byte of b added a's first sum to the second sum once more
+    a->fletcher_two = (a->fletcher_two + b->fletcher_two + (len_b % 255) * a->fletcher_one) % 255;
+    a->fletcher_one = (a->fletcher_one + b->fletcher_one) % 255;
+
+    // on the finished CRC values: shift a's past b's bytes, then add b's
+    if (a->selected & DIGEST_CRC32) {
+        uint32_t crc_a = a->crc ^ 0xFFFFFFFFu;
+        uint32_t crc_b = b->crc ^ 0xFFFFFFFFu;
+        a->crc = (crc32_multmodp(crc32_x8nmodp(len_b), crc_a) ^ crc_b) ^ 0xFFFFFFFFu;
+    }
+}
+
+#endif
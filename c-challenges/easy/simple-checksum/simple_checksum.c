@@ -47,9 +47,44 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <string.h>
+#include <time.h>
+#include <sys/uio.h>
 
-uint8_t simple_checksum(const uint8_t *data, size_t len) {
+#include "multi_digest.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS 1
+#endif
+
+// the kernel families below pick their kernels on first use, and that first
+// use can come from several threads at once. same scheme as crc32_init_table
+// in multi_digest.h: state is 0 = not done, 1 = being done, 2 = done. the
+// caller that gets 1 back does the setup and then calls init_done - anyone
+// else waits until it has
+int init_claim(int *state) {
+    if (__atomic_load_n(state, __ATOMIC_ACQUIRE) == 2) {
+        return 0;
+    }
+
+    int expected = 0;
+    if (__atomic_compare_exchange_n(state, &expected, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+        return 1;
+    }
+
+    while (__atomic_load_n(state, __ATOMIC_ACQUIRE) != 2) {
+        // someone else is doing it
+    }
+    return 0;
+}
+
+void init_done(int *state) {
+    __atomic_store_n(state, 2, __ATOMIC_RELEASE);
+}
+
+uint8_t simple_checksum_bytewise(const uint8_t *data, size_t len) {
     // simple check sum -> add all bytes in data, return the lowest 8 bits
 
     uint16_t sum = 0;
@@ -62,7 +97,7 @@ uint8_t simple_checksum(const uint8_t *data, size_t len) {
     return (uint8_t)sum;
 }
 
-uint8_t xor_checksum(const uint8_t *data, size_t len) {
+uint8_t xor_checksum_bytewise(const uint8_t *data, size_t len) {
     uint8_t xor_result = 0;
 
     size_t i = 0;
@@ -74,7 +109,187 @@ uint8_t xor_checksum(const uint8_t *data, size_t len) {
     return xor_result;
 }
 
-uint16_t fletcher16(const uint8_t *data, size_t len) {
+// ========== Wide simple and XOR checksums ==========
+// the two above look at one byte per step, and only go wide if the compiler
+// happens to vectorize them. the sum only needs its low 8 bits and xor is
+// order-free, so both can swallow a whole vector per step: a SAD
+// against zero adds up 8 bytes per 64-bit lane, and xor of 64-bit lanes
+// folds down to one byte at the end
+
+// sum kernels return the whole 64-bit byte sum - simple_checksum keeps the low 8 bits
+typedef uint64_t (*byte_sum_fn)(const uint8_t *data, size_t len);
+typedef uint8_t (*byte_xor_fn)(const uint8_t *data, size_t len);
+
+uint64_t byte_sum_scalar(const uint8_t *data, size_t len) {
+    uint64_t sum = 0;
+    for (size_t i = 0; i < len; i++) {
+        sum += data[i];
+    }
+    return sum;
+}
+
+// xors the 8 bytes of a word together
+uint8_t fold_xor64(uint64_t word) {
+    word ^= word >> 32;
+    word ^= word >> 16;
+    word ^= word >> 8;
+    return (uint8_t)word;
+}
+
+// 8 bytes at a time, as multi_digest.h does
+uint8_t byte_xor_scalar(const uint8_t *data, size_t len) {
+    uint64_t word_xor = 0;
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, sizeof(word));
+        word_xor ^= word;
+    }
+
+    uint8_t x = fold_xor64(word_xor);
+    for (; i < len; i++) {
+        x ^= data[i];
+    }
+    return x;
+}
+
+#ifdef HAVE_X86_KERNELS
+// 64 bytes per loop - two loads, so the adds of one hide behind the other
+__attribute__((target("avx2")))
+uint64_t byte_sum_avx2(const uint8_t *data, size_t len) {
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i sum_a = zero;
+    __m256i sum_b = zero;
+
+    size_t i = 0;
+    for (; i + 64 <= len; i += 64) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(data + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(data + i + 32));
+        sum_a = _mm256_add_epi64(sum_a, _mm256_sad_epu8(a, zero));
+        sum_b = _mm256_add_epi64(sum_b, _mm256_sad_epu8(b, zero));
+    }
+
+    __m256i sum = _mm256_add_epi64(sum_a, sum_b);
+    __m128i half = _mm_add_epi64(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+    uint64_t total = (uint64_t)_mm_cvtsi128_si64(half) + (uint64_t)_mm_extract_epi64(half, 1);
+
+    return total + byte_sum_scalar(data + i, len - i);
+}
+
+__attribute__((target("avx2")))
+uint8_t byte_xor_avx2(const uint8_t *data, size_t len) {
+    __m256i x_a = _mm256_setzero_si256();
+    __m256i x_b = _mm256_setzero_si256();
+
+    size_t i = 0;
+    for (; i + 64 <= len; i += 64) {
+        x_a = _mm256_xor_si256(x_a, _mm256_loadu_si256((const __m256i *)(data + i)));
+        x_b = _mm256_xor_si256(x_b, _mm256_loadu_si256((const __m256i *)(data + i + 32)));
+    }
+
+    __m256i x = _mm256_xor_si256(x_a, x_b);
+    __m128i half = _mm_xor_si128(_mm256_castsi256_si128(x), _mm256_extracti128_si256(x, 1));
+    uint64_t word = (uint64_t)_mm_cvtsi128_si64(half) ^ (uint64_t)_mm_extract_epi64(half, 1);
+
+    return fold_xor64(word) ^ byte_xor_scalar(data + i, len - i);
+}
+
+// 64 bytes per instruction, and a masked load takes the ragged end so
+// there's no scalar tail
+__attribute__((target("avx512f,avx512bw,bmi2")))
+uint64_t byte_sum_avx512(const uint8_t *data, size_t len) {
+    const __m512i zero = _mm512_setzero_si512();
+    __m512i sum = zero;
+
+    size_t i = 0;
+    for (; i + 64 <= len; i += 64) {
+        __m512i v = _mm512_loadu_si512((const void *)(data + i));
+        sum = _mm512_add_epi64(sum, _mm512_sad_epu8(v, zero));
+    }
+    if (i < len) {
+        __mmask64 mask = _bzhi_u64(~0ull, (unsigned)(len - i));
+        __m512i v = _mm512_maskz_loadu_epi8(mask, data + i);
+        sum = _mm512_add_epi64(sum, _mm512_sad_epu8(v, zero));
+    }
+
+    return (uint64_t)_mm512_reduce_add_epi64(sum);
+}
+
+__attribute__((target("avx512f,avx512bw,bmi2")))
+uint8_t byte_xor_avx512(const uint8_t *data, size_t len) {
+    __m512i x = _mm512_setzero_si512();
+
+    size_t i = 0;
+    for (; i + 64 <= len; i += 64) {
+        x = _mm512_xor_si512(x, _mm512_loadu_si512((const void *)(data + i)));
+    }
+    if (i < len) {
+        __mmask64 mask = _bzhi_u64(~0ull, (unsigned)(len - i));
+        x = _mm512_xor_si512(x, _mm512_maskz_loadu_epi8(mask, data + i));
+    }
+
+    __m256i quarter = _mm256_xor_si256(_mm512_castsi512_si256(x), _mm512_extracti64x4_epi64(x, 1));
+    __m128i half = _mm_xor_si128(_mm256_castsi256_si128(quarter), _mm256_extracti128_si256(quarter, 1));
+    uint64_t word = (uint64_t)_mm_cvtsi128_si64(half) ^ (uint64_t)_mm_extract_epi64(half, 1);
+
+    return fold_xor64(word);
+}
+#endif
+
+// every kernel, so main can check them against each other
+typedef struct {
+    const char *name;
+    byte_sum_fn sum;
+    byte_xor_fn xor_fn;
+    int available;
+} ByteOpsKernel;
+
+ByteOpsKernel byte_ops_kernels[] = {
+    { "scalar", byte_sum_scalar, byte_xor_scalar, 1 },
+#ifdef HAVE_X86_KERNELS
+    { "avx2", byte_sum_avx2, byte_xor_avx2, 0 },
+    { "avx512", byte_sum_avx512, byte_xor_avx512, 0 },
+#endif
+};
+#define BYTE_OPS_KERNEL_COUNT (sizeof(byte_ops_kernels) / sizeof(byte_ops_kernels[0]))
+
+ByteOpsKernel *byte_ops_kernel = &byte_ops_kernels[0];
+int byte_ops_state = 0; // ... see init_claim
+
+// picks the widest kernel this CPU can run
+void byte_ops_init(void) {
+    if (!init_claim(&byte_ops_state)) {
+        return;
+    }
+
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    byte_ops_kernels[1].available = __builtin_cpu_supports("avx2");
+    byte_ops_kernels[2].available = __builtin_cpu_supports("avx512f") &&
+                                    __builtin_cpu_supports("avx512bw") &&
+                                    __builtin_cpu_supports("bmi2");
+    for (size_t i = 1; i < BYTE_OPS_KERNEL_COUNT; i++) {
+        if (byte_ops_kernels[i].available) {
+            byte_ops_kernel = &byte_ops_kernels[i];
+        }
+    }
+#endif
+
+    init_done(&byte_ops_state);
+}
+
+// same results as the bytewise versions
+uint8_t simple_checksum(const uint8_t *data, size_t len) {
+    byte_ops_init();
+    return (uint8_t)byte_ops_kernel->sum(data, len);
+}
+
+uint8_t xor_checksum(const uint8_t *data, size_t len) {
+    byte_ops_init();
+    return byte_ops_kernel->xor_fn(data, len);
+}
+
+uint16_t fletcher16_bytewise(const uint8_t *data, size_t len) {
     // sum one, sum in order, modulo 255 each time
     // sum of results form each sum in sum one, modulo 255 each time
 
@@ -96,7 +311,1212 @@ uint16_t fletcher16(const uint8_t *data, size_t len) {
     return (sum_two << 8) | sum_one;
 }
 
-int main() {
+// ========== Fletcher-16, Fletcher-32 and Adler-32 ==========
+// the bytewise version above does two % 255 per byte, and the divide is what
+// it spends its time on. the sums only have to be reduced before they can
+// overflow - so add up a whole block in 32 bits, then reduce once.
+// all three are the same pair of running sums (one += x, two += one), over
+// bytes mod 255 (Fletcher-16), 16-bit words mod 65535 (Fletcher-32) or bytes
+// mod 65521 starting from one = 1 (Adler-32, as in zlib)
+
+// the most bytes that can be summed from reduced values before `two` could
+// pass 2^32: n(n+1)/2 * 255 + (n+1) * (M-1) < 2^32
+#define FLETCHER16_BLOCK 5802
+#define ADLER32_BLOCK 5552 // ... zlib's NMAX
+#define FLETCHER32_BLOCK (359 * 2) // ... 359 words
+#define ADLER32_MOD 65521
+
+// adds len bytes (or little-endian 16-bit words, for Fletcher-32) to the two
+// sums without reducing. the caller keeps len within the block size
+typedef void (*sums_kernel_fn)(uint64_t *one, uint64_t *two, const uint8_t *data, size_t len);
+
+void byte_sums_scalar(uint64_t *one, uint64_t *two, const uint8_t *data, size_t len) {
+    uint32_t a = (uint32_t)*one;
+    uint32_t b = (uint32_t)*two;
+
+    for (size_t i = 0; i < len; i++) {
+        a += data[i];
+        b += a;
+    }
+
+    *one = a;
+    *two = b;
+}
+
+void word_sums_scalar(uint64_t *one, uint64_t *two, const uint8_t *data, size_t len) {
+    uint32_t a = (uint32_t)*one;
+    uint32_t b = (uint32_t)*two;
+
+    size_t i = 0;
+    for (; i + 2 <= len; i += 2) {
+        a += data[i] | (uint32_t)data[i + 1] << 8;
+        b += a;
+    }
+    if (i < len) {
+        // odd length - the last byte is a word with a zero high byte
+        a += data[i];
+        b += a;
+    }
+
+    *one = a;
+    *two = b;
+}
+
+#ifdef HAVE_X86_KERNELS
+// adds up the 32-bit lanes of v
+__attribute__((target("avx2")))
+int64_t hsum_epi32(__m256i v) {
+    __m128i s = _mm_add_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0x4E));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0xB1));
+    return (int32_t)_mm_cvtsi128_si32(s);
+}
+
+// 32 bytes per step. for a step starting with sums (a, b):
+//   a' = a + sum(bytes)
+//   b' = b + 32a + 32*d0 + 31*d1 + ... + 1*d31
+// the byte sum is one SAD against zero, the weighted sum one maddubs against
+// 32..1. the 32a terms are collected as `prev` (a at each step's start) and
+// applied once at the end
+__attribute__((target("avx2")))
+void byte_sums_avx2(uint64_t *one, uint64_t *two, const uint8_t *data, size_t len) {
+    size_t steps = len / 32;
+    if (steps > 0) {
+        const __m256i weights = _mm256_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25,
+                                                 24, 23, 22, 21, 20, 19, 18, 17,
+                                                 16, 15, 14, 13, 12, 11, 10, 9,
+                                                 8, 7, 6, 5, 4, 3, 2, 1);
+        const __m256i ones = _mm256_set1_epi16(1);
+        const __m256i zero = _mm256_setzero_si256();
+        __m256i sum = zero; // ... bytes so far in this call
+        __m256i prev = zero; // ... sum of `sum` at the start of each step
+        __m256i weighted = zero;
+
+        for (size_t s = 0; s < steps; s++) {
+            __m256i v = _mm256_loadu_si256((const __m256i *)(data + s * 32));
+            prev = _mm256_add_epi32(prev, sum);
+            sum = _mm256_add_epi32(sum, _mm256_sad_epu8(v, zero));
+            weighted = _mm256_add_epi32(weighted,
+                                        _mm256_madd_epi16(_mm256_maddubs_epi16(v, weights), ones));
+        }
+
+        uint64_t bytes = steps * 32;
+        *two += bytes * *one + 32 * (uint64_t)hsum_epi32(prev) + (uint64_t)hsum_epi32(weighted);
+        *one += (uint64_t)hsum_epi32(sum);
+    }
+
+    byte_sums_scalar(one, two, data + steps * 32, len - steps * 32);
+}
+
+// the same for 16 little-endian words per step. madd_epi16 is signed, so
+// each word has 32768 taken off (flip the top bit) and the offsets are
+// added back at the end
+__attribute__((target("avx2")))
+void word_sums_avx2(uint64_t *one, uint64_t *two, const uint8_t *data, size_t len) {
+    size_t steps = len / 32;
+    if (steps > 0) {
+        const __m256i weights = _mm256_setr_epi16(16, 15, 14, 13, 12, 11, 10, 9,
+                                                  8, 7, 6, 5, 4, 3, 2, 1);
+        const __m256i ones = _mm256_set1_epi16(1);
+        const __m256i flip = _mm256_set1_epi16((short)0x8000);
+        __m256i sum = _mm256_setzero_si256();
+        __m256i prev = sum;
+        __m256i weighted = sum;
+
+        for (size_t s = 0; s < steps; s++) {
+            __m256i v = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(data + s * 32)), flip);
+            prev = _mm256_add_epi32(prev, sum);
+            sum = _mm256_add_epi32(sum, _mm256_madd_epi16(v, ones));
+            weighted = _mm256_add_epi32(weighted, _mm256_madd_epi16(v, weights));
+        }
+
+        // put the 32768s back: 16 per step in sum, 16+15+...+1 = 136 per
+        // step in weighted, and 16 for every earlier step in prev
+        int64_t offset = 32768;
+        int64_t k = (int64_t)steps;
+        int64_t true_sum = hsum_epi32(sum) + offset * 16 * k;
+        int64_t true_prev = hsum_epi32(prev) + offset * 16 * (k * (k - 1) / 2);
+        int64_t true_weighted = hsum_epi32(weighted) + offset * 136 * k;
+
+        *two += 16 * (uint64_t)k * *one + 16 * (uint64_t)true_prev + (uint64_t)true_weighted;
+        *one += (uint64_t)true_sum;
+    }
+
+    word_sums_scalar(one, two, data + steps * 32, len - steps * 32);
+}
+#endif
+
+// every kernel, so main can check them against each other
+typedef struct {
+    const char *name;
+    sums_kernel_fn bytes;
+    sums_kernel_fn words;
+    int available;
+} SumsKernel;
+
+SumsKernel sums_kernels[] = {
+    { "scalar", byte_sums_scalar, word_sums_scalar, 1 },
+#ifdef HAVE_X86_KERNELS
+    { "avx2", byte_sums_avx2, word_sums_avx2, 0 },
+#endif
+};
+#define SUMS_KERNEL_COUNT (sizeof(sums_kernels) / sizeof(sums_kernels[0]))
+
+SumsKernel *sums_kernel = &sums_kernels[0];
+int sums_state = 0; // ... see init_claim
+
+// picks the widest kernel this CPU can run
+void sums_init(void) {
+    if (!init_claim(&sums_state)) {
+        return;
+    }
+
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    sums_kernels[1].available = __builtin_cpu_supports("avx2");
+    if (sums_kernels[1].available) {
+        sums_kernel = &sums_kernels[1];
+    }
+#endif
+
+    init_done(&sums_state);
+}
+
+// runs a kernel over data a block at a time, reducing between blocks
+void fletcher_sums(sums_kernel_fn kernel, uint64_t *one, uint64_t *two, uint32_t mod,
+                   size_t block, const uint8_t *data, size_t len) {
+    while (len > 0) {
+        size_t n = len < block ? len : block;
+        kernel(one, two, data, n);
+        *one %= mod;
+        *two %= mod;
+        data += n;
+        len -= n;
+    }
+}
+
+// the update functions carry on from an earlier result - the result holds
+// both sums, so nothing else needs keeping. start from 0 (Fletcher) or 1 (Adler)
+uint16_t fletcher16_update(uint16_t fletcher, const uint8_t *data, size_t len) {
+    sums_init();
+    uint64_t one = fletcher & 0xFF;
+    uint64_t two = fletcher >> 8;
+    fletcher_sums(sums_kernel->bytes, &one, &two, 255, FLETCHER16_BLOCK, data, len);
+    return (uint16_t)(two << 8 | one);
+}
+
+// an odd length only works as the last piece - the final byte is padded out
+// to a word
+uint32_t fletcher32_update(uint32_t fletcher, const uint8_t *data, size_t len) {
+    sums_init();
+    uint64_t one = fletcher & 0xFFFF;
+    uint64_t two = fletcher >> 16;
+    fletcher_sums(sums_kernel->words, &one, &two, 65535, FLETCHER32_BLOCK, data, len);
+    return (uint32_t)(two << 16 | one);
+}
+
+uint32_t adler32_update(uint32_t adler, const uint8_t *data, size_t len) {
+    sums_init();
+    uint64_t one = adler & 0xFFFF;
+    uint64_t two = adler >> 16;
+    fletcher_sums(sums_kernel->bytes, &one, &two, ADLER32_MOD, ADLER32_BLOCK, data, len);
+    return (uint32_t)(two << 16 | one);
+}
+
+// same result as fletcher16_bytewise, a lot faster
+uint16_t fletcher16(const uint8_t *data, size_t len) {
+    return fletcher16_update(0, data, len);
+}
+
+uint32_t fletcher32(const uint8_t *data, size_t len) {
+    return fletcher32_update(0, data, len);
+}
+
+uint32_t adler32(const uint8_t *data, size_t len) {
+    return adler32_update(1, data, len);
+}
+
+// reduce-every-step references for main to check the block versions against
+uint32_t fletcher32_bytewise(const uint8_t *data, size_t len) {
+    uint32_t sum_one = 0;
+    uint32_t sum_two = 0;
+
+    for (size_t i = 0; i < len; i += 2) {
+        uint32_t word = data[i];
+        if (i + 1 < len) {
+            word |= (uint32_t)data[i + 1] << 8;
+        }
+        sum_one = (sum_one + word) % 65535;
+        sum_two = (sum_two + sum_one) % 65535;
+    }
+
+    return (sum_two << 16) | sum_one;
+}
+
+uint32_t adler32_bytewise(const uint8_t *data, size_t len) {
+    uint32_t sum_one = 1;
+    uint32_t sum_two = 0;
+
+    for (size_t i = 0; i < len; i++) {
+        sum_one = (sum_one + data[i]) % ADLER32_MOD;
+        sum_two = (sum_two + sum_one) % ADLER32_MOD;
+    }
+
+    return (sum_two << 16) | sum_one;
+}
+
+// ========== CRC-32 and CRC-32C ==========
+// the sums above miss a lot (swapped bytes, zeroed runs...). a CRC catches
+// every burst error up to 32 bits long. two polynomials, both reflected:
+// IEEE 802.3 (CRC32_POLY, from multi_digest.h - zlib, PNG, ethernet) and
+// Castagnoli (iSCSI, ext4, and the one the SSE4.2 crc32 instruction does)
+#define CRC32C_POLY 0x82F63B78u
+
+// buffers shorter than this skip the PCLMUL folding - setting it up and
+// reducing at the end costs about as much as table lookups on 256 bytes
+#define CRC_FOLD_MIN 256
+
+typedef struct CrcAlgo CrcAlgo;
+
+// a kernel runs over the raw (pre-inverted) CRC state
+typedef uint32_t (*crc_kernel_fn)(const CrcAlgo *algo, uint32_t state,
+                                  const uint8_t *data, size_t len);
+
+struct CrcAlgo {
+    const char *name;
+    uint32_t poly; // ... reflected
+    uint32_t table[8][256]; // ... slicing-by-8, table[0] is the byte-at-a-time table
+    uint64_t fold4[2]; // ... x^(4*128+32), x^(4*128-32) mod P - folds 64 bytes at a time
+    uint64_t fold1[2]; // ... x^(128+32), x^(128-32) mod P - folds 16 bytes at a time
+    uint64_t fold64[2]; // ... x^64 mod P, 128 bits down to 64
+    uint64_t barrett[2]; // ... P and floor(x^64 / P), 64 bits down to 32
+    uint32_t x2n[64]; // ... x^(2^k) mod P, for shifting a CRC past n zero bytes
+    crc_kernel_fn kernel; // ... picked at init for this CPU
+    crc_kernel_fn small; // ... what kernel hands short buffers and tails to
+};
+
+CrcAlgo crc32_ieee_algo = { .name = "CRC-32", .poly = CRC32_POLY };
+CrcAlgo crc32c_algo = { .name = "CRC-32C", .poly = CRC32C_POLY };
+int crc_state = 0; // ... see init_claim
+
+// a * b modulo the polynomial, reflected (bit 31 is x^0) - the same as
+// crc32_multmodp in multi_digest.h, for either polynomial
+uint32_t crc_multmodp(uint32_t poly, uint32_t a, uint32_t b) {
+    uint32_t m = 1u << 31;
+    uint32_t p = 0;
+
+    while (m != 0) {
+        if (a & m) {
+            p ^= b;
+        }
+        m >>= 1;
+        b = b & 1 ? (b >> 1) ^ poly : b >> 1;
+    }
+
+    return p;
+}
+
+// x^n modulo the polynomial, reflected
+uint32_t crc_xnmodp(uint32_t poly, unsigned n) {
+    uint32_t p = 1u << 31; // ... x^0
+    uint32_t square = 1u << 30; // ... x^1
+
+    while (n != 0) {
+        if (n & 1) {
+            p = crc_multmodp(poly, square, p);
+        }
+        square = crc_multmodp(poly, square, square);
+        n >>= 1;
+    }
+
+    return p;
+}
+
+// reverses the low `bits` bits of v
+uint64_t reflect_bits(uint64_t v, int bits) {
+    uint64_t r = 0;
+    for (int i = 0; i < bits; i++) {
+        if (v & (1ull << i)) {
+            r |= 1ull << (bits - 1 - i);
+        }
+    }
+    return r;
+}
+
+// the folding constants from Intel's "Fast CRC Computation Using PCLMULQDQ"
+// paper, worked out from the polynomial instead of copied in, so the one
+// kernel serves both CRCs. in the reflected domain (x^n mod P) << 1 is the
+// bit-reversed 33-bit constant the paper wants
+void crc_init_fold_constants(CrcAlgo *algo) {
+    algo->fold4[0] = (uint64_t)crc_xnmodp(algo->poly, 4 * 128 + 32) << 1;
+    algo->fold4[1] = (uint64_t)crc_xnmodp(algo->poly, 4 * 128 - 32) << 1;
+    algo->fold1[0] = (uint64_t)crc_xnmodp(algo->poly, 128 + 32) << 1;
+    algo->fold1[1] = (uint64_t)crc_xnmodp(algo->poly, 128 - 32) << 1;
+    algo->fold64[0] = (uint64_t)crc_xnmodp(algo->poly, 64) << 1;
+    algo->fold64[1] = 0;
+
+    // Barrett reduction wants the full 33-bit P and the quotient x^64 / P,
+    // found by long division in normal bit order, then both reflected
+    uint64_t p = (1ull << 32) | reflect_bits(algo->poly, 32);
+    unsigned __int128 rem = (unsigned __int128)1 << 64;
+    uint64_t quotient = 0;
+
+    for (int i = 32; i >= 0; i--) {
+        if ((uint64_t)(rem >> (i + 32)) & 1) {
+            quotient |= 1ull << i;
+            rem ^= (unsigned __int128)p << i;
+        }
+    }
+
+    algo->barrett[0] = reflect_bits(p, 33);
+    algo->barrett[1] = reflect_bits(quotient, 33);
+}
+
+// x^1, x^2, x^4 ... mod P, each the square of the last
+void crc_init_powers(CrcAlgo *algo) {
+    uint32_t p = 1u << 30; // ... x^1
+    for (int k = 0; k < 64; k++) {
+        algo->x2n[k] = p;
+        p = crc_multmodp(algo->poly, p, p);
+    }
+}
+
+void crc_init_tables(CrcAlgo *algo) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) {
+            c = c & 1 ? (c >> 1) ^ algo->poly : c >> 1;
+        }
+        algo->table[0][i] = c;
+    }
+
+    // table[k][i] is byte i followed by k zero bytes
+    for (int k = 1; k < 8; k++) {
+        for (int i = 0; i < 256; i++) {
+            uint32_t c = algo->table[k - 1][i];
+            algo->table[k][i] = (c >> 8) ^ algo->table[0][c & 0xFF];
+        }
+    }
+}
+
+// the textbook version - one lookup per byte. kept as the reference
+uint32_t crc_bytewise(const CrcAlgo *algo, uint32_t state, const uint8_t *data, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        state = algo->table[0][(state ^ data[i]) & 0xFF] ^ (state >> 8);
+    }
+    return state;
+}
+
+// slicing-by-8: eight independent lookups per 8 bytes instead of a chain
+// of eight dependent ones. works anywhere, no special instructions
+uint32_t crc_slice8(const CrcAlgo *algo, uint32_t state, const uint8_t *data, size_t len) {
+    while (len >= 8) {
+        uint32_t low, high;
+        memcpy(&low, data, 4); // ... little-endian, like the reflected CRC
+        memcpy(&high, data + 4, 4);
+        low ^= state;
+
+        state = algo->table[7][low & 0xFF] ^
+                algo->table[6][(low >> 8) & 0xFF] ^
+                algo->table[5][(low >> 16) & 0xFF] ^
+                algo->table[4][low >> 24] ^
+                algo->table[3][high & 0xFF] ^
+                algo->table[2][(high >> 8) & 0xFF] ^
+                algo->table[1][(high >> 16) & 0xFF] ^
+                algo->table[0][high >> 24];
+
+        data += 8;
+        len -= 8;
+    }
+
+    return crc_bytewise(algo, state, data, len);
+}
+
+#ifdef HAVE_X86_KERNELS
+// SSE4.2 has a crc32 instruction, but only for the Castagnoli polynomial.
+// 8 bytes per instruction - the algo argument is only there to fit crc_kernel_fn
+__attribute__((target("sse4.2")))
+uint32_t crc32c_sse42(const CrcAlgo *algo, uint32_t state, const uint8_t *data, size_t len) {
+    (void)algo;
+
+    // line up on 8 bytes first
+    while (len > 0 && ((uintptr_t)data & 7) != 0) {
+        state = _mm_crc32_u8(state, *data);
+        data++;
+        len--;
+    }
+
+    uint64_t wide = state;
+    while (len >= 8) {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        wide = _mm_crc32_u64(wide, word);
+        data += 8;
+        len -= 8;
+    }
+    state = (uint32_t)wide;
+
+    while (len > 0) {
+        state = _mm_crc32_u8(state, *data);
+        data++;
+        len--;
+    }
+
+    return state;
+}
+
+// carry-less multiply folding (Intel's PCLMULQDQ paper). four 128-bit lanes
+// each multiply their running remainder by x^512 mod P and xor in the next
+// 64 bytes, so the work is a few multiplies per 64 bytes whatever the
+// polynomial. at the end the lanes fold into one and Barrett-reduce to 32 bits
+__attribute__((target("pclmul,sse4.1")))
+uint32_t crc_pclmul(const CrcAlgo *algo, uint32_t state, const uint8_t *data, size_t len) {
+    if (len < CRC_FOLD_MIN) {
+        return algo->small(algo, state, data, len);
+    }
+
+    size_t tail = len & 15;
+    len -= tail;
+
+    __m128i x1 = _mm_loadu_si128((const __m128i *)(data + 0));
+    __m128i x2 = _mm_loadu_si128((const __m128i *)(data + 16));
+    __m128i x3 = _mm_loadu_si128((const __m128i *)(data + 32));
+    __m128i x4 = _mm_loadu_si128((const __m128i *)(data + 48));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)state));
+    data += 64;
+    len -= 64;
+
+    __m128i k = _mm_set_epi64x((long long)algo->fold4[1], (long long)algo->fold4[0]);
+    while (len >= 64) {
+        __m128i x5 = _mm_clmulepi64_si128(x1, k, 0x00);
+        __m128i x6 = _mm_clmulepi64_si128(x2, k, 0x00);
+        __m128i x7 = _mm_clmulepi64_si128(x3, k, 0x00);
+        __m128i x8 = _mm_clmulepi64_si128(x4, k, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, k, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, k, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, k, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, k, 0x11);
+
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i *)(data + 0)));
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((const __m128i *)(data + 16)));
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((const __m128i *)(data + 32)));
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((const __m128i *)(data + 48)));
+
+        data += 64;
+        len -= 64;
+    }
+
+    // four lanes down to one
+    k = _mm_set_epi64x((long long)algo->fold1[1], (long long)algo->fold1[0]);
+    __m128i x5 = _mm_clmulepi64_si128(x1, k, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+    x5 = _mm_clmulepi64_si128(x1, k, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+    x5 = _mm_clmulepi64_si128(x1, k, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    // any 16-byte pieces left over from the 64-byte loop
+    while (len >= 16) {
+        x2 = _mm_loadu_si128((const __m128i *)data);
+        x5 = _mm_clmulepi64_si128(x1, k, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, k, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+        data += 16;
+        len -= 16;
+    }
+
+    // 128 bits down to 64
+    __m128i mask = _mm_setr_epi32(-1, 0, -1, 0);
+    x2 = _mm_clmulepi64_si128(x1, k, 0x10);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+    k = _mm_set_epi64x(0, (long long)algo->fold64[0]);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask), k, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    // Barrett reduction, 64 bits down to 32
+    k = _mm_set_epi64x((long long)algo->barrett[1], (long long)algo->barrett[0]);
+    x2 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask), k, 0x10);
+    x2 = _mm_clmulepi64_si128(_mm_and_si128(x2, mask), k, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+    state = (uint32_t)_mm_extract_epi32(x1, 1);
+
+    return algo->small(algo, state, data, tail);
+}
+#endif
+
+// every kernel, so main can check them against each other. available is
+// filled in by crc_init from what this CPU supports
+typedef struct {
+    const char *name;
+    crc_kernel_fn fn;
+    uint32_t only_poly; // ... 0 if it works for either polynomial
+    int available;
+} CrcKernel;
+
+CrcKernel crc_kernels[] = {
+    { "bytewise", crc_bytewise, 0, 1 },
+    { "slice-by-8", crc_slice8, 0, 1 },
+#ifdef HAVE_X86_KERNELS
+    { "sse4.2", crc32c_sse42, CRC32C_POLY, 0 },
+    { "pclmul", crc_pclmul, 0, 0 },
+#endif
+};
+#define CRC_KERNEL_COUNT (sizeof(crc_kernels) / sizeof(crc_kernels[0]))
+
+// builds the tables and picks the fastest kernels this CPU can run.
+// cheap after the first call - the checksum functions call it themselves
+void crc_init(void) {
+    if (!init_claim(&crc_state)) {
+        return;
+    }
+
+    crc_init_tables(&crc32_ieee_algo);
+    crc_init_tables(&crc32c_algo);
+    crc_init_fold_constants(&crc32_ieee_algo);
+    crc_init_fold_constants(&crc32c_algo);
+    crc_init_powers(&crc32_ieee_algo);
+    crc_init_powers(&crc32c_algo);
+
+    crc32_ieee_algo.kernel = crc_slice8;
+    crc32_ieee_algo.small = crc_slice8;
+    crc32c_algo.kernel = crc_slice8;
+    crc32c_algo.small = crc_slice8;
+
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    int have_sse42 = __builtin_cpu_supports("sse4.2");
+    int have_pclmul = __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1");
+
+    // short CRC-32C buffers go to the crc32 instruction, long ones of either
+    // CRC to folding (the crc32 instruction waits 3 cycles on each result,
+    // the four folding lanes don't wait on each other)
+    if (have_sse42) {
+        crc32c_algo.kernel = crc32c_sse42;
+        crc32c_algo.small = crc32c_sse42;
+    }
+    if (have_pclmul) {
+        crc32_ieee_algo.kernel = crc_pclmul;
+        crc32c_algo.kernel = crc_pclmul;
+    }
+
+    for (size_t i = 0; i < CRC_KERNEL_COUNT; i++) {
+        if (crc_kernels[i].fn == crc32c_sse42) {
+            crc_kernels[i].available = have_sse42;
+        } else if (crc_kernels[i].fn == crc_pclmul) {
+            crc_kernels[i].available = have_pclmul;
+        }
+    }
+#endif
+
+    init_done(&crc_state);
+}
+
+const char *crc_kernel_name(crc_kernel_fn fn) {
+    for (size_t i = 0; i < CRC_KERNEL_COUNT; i++) {
+        if (crc_kernels[i].fn == fn) {
+            return crc_kernels[i].name;
+        }
+    }
+    return "unknown";
+}
+
+// zlib-style: pass 0 to start, or a previous result to carry on after it
+uint32_t crc32_ieee_update(uint32_t crc, const uint8_t *data, size_t len) {
+    crc_init();
+    return crc32_ieee_algo.kernel(&crc32_ieee_algo, crc ^ 0xFFFFFFFFu, data, len) ^ 0xFFFFFFFFu;
+}
+
+uint32_t crc32c_update(uint32_t crc, const uint8_t *data, size_t len) {
+    crc_init();
+    return crc32c_algo.kernel(&crc32c_algo, crc ^ 0xFFFFFFFFu, data, len) ^ 0xFFFFFFFFu;
+}
+
+uint32_t crc32_ieee(const uint8_t *data, size_t len) {
+    return crc32_ieee_update(0, data, len);
+}
+
+uint32_t crc32c(const uint8_t *data, size_t len) {
+    return crc32c_update(0, data, len);
+}
+
+// ========== Combining partial checksums ==========
+// each function takes the checksums of two neighbouring pieces, a then b,
+// and gives the checksum of the two back to back - without the data. so a
+// big buffer can be split across threads, or pieces arriving out of order
+// from the network or disk can be checksummed as they land and merged later
+
+uint8_t simple_checksum_combine(uint8_t a, uint8_t b) {
+    return (uint8_t)(a + b);
+}
+
+uint8_t xor_checksum_combine(uint8_t a, uint8_t b) {
+    return a ^ b;
+}
+
+// every byte of b added a's first sum to the second sum once more, so b's
+// second sum is short by len_b * a's first sum
+uint16_t fletcher16_combine(uint16_t a, uint16_t b, uint64_t len_b) {
+    uint64_t one_a = a & 0xFF;
+    uint64_t two_a = a >> 8;
+    uint64_t one = (one_a + (b & 0xFF)) % 255;
+    uint64_t two = (two_a + (b >> 8) + (len_b % 255) * one_a) % 255;
+    return (uint16_t)(two << 8 | one);
+}
+
+// the same per 16-bit word - a has to be an even number of bytes
+uint32_t fletcher32_combine(uint32_t a, uint32_t b, uint64_t len_b) {
+    uint64_t words = (len_b + 1) / 2;
+    uint64_t one_a = a & 0xFFFF;
+    uint64_t two_a = a >> 16;
+    uint64_t one = (one_a + (b & 0xFFFF)) % 65535;
+    uint64_t two = (two_a + (b >> 16) + (words % 65535) * one_a) % 65535;
+    return (uint32_t)(two << 16 | one);
+}
+
+// like Fletcher, except both pieces started their first sum at 1 - so one
+// of those 1s comes off the first sum, and len_b of them off the second
+uint32_t adler32_combine(uint32_t a, uint32_t b, uint64_t len_b) {
+    uint64_t rem = len_b % ADLER32_MOD;
+    uint64_t one_a = a & 0xFFFF;
+    uint64_t two_a = a >> 16;
+    uint64_t one = (one_a + (b & 0xFFFF) + ADLER32_MOD - 1) % ADLER32_MOD;
+    uint64_t two = (two_a + (b >> 16) + rem * one_a + ADLER32_MOD - rem) % ADLER32_MOD;
+    return (uint32_t)(two << 16 | one);
+}
+
+// x^(8 * bytes) mod P out of the x^(2^k) table - one multiply per set bit
+// of the length rather than squaring as it goes
+uint32_t crc_x8nmodp(const CrcAlgo *algo, uint64_t bytes) {
+    uint32_t p = 1u << 31; // ... x^0
+    int k = 3; // ... one byte is x^8 = x^(2^3)
+
+    while (bytes != 0) {
+        if (bytes & 1) {
+            p = crc_multmodp(algo->poly, algo->x2n[k & 63], p);
+        }
+        bytes >>= 1;
+        k++;
+    }
+
+    return p;
+}
+
+// a CRC is linear, so crc(a then b) is crc(a) shifted past len_b zero bytes,
+// xor crc(b). the pre and post inversions cancel out of that
+uint32_t crc_combine(const CrcAlgo *algo, uint32_t a, uint32_t b, uint64_t len_b) {
+    crc_init();
+    return crc_multmodp(algo->poly, crc_x8nmodp(algo, len_b), a) ^ b;
+}
+
+uint32_t crc32_ieee_combine(uint32_t a, uint32_t b, uint64_t len_b) {
+    return crc_combine(&crc32_ieee_algo, a, b, len_b);
+}
+
+uint32_t crc32c_combine(uint32_t a, uint32_t b, uint64_t len_b) {
+    return crc_combine(&crc32c_algo, a, b, len_b);
+}
+
+// ========== Streaming contexts ==========
+// for data that arrives in fragments: init, update with each fragment (any
+// size, in order), final. a message split over several buffers no longer
+// needs copying into one just to be checksummed - hand over an iovec and
+// checksum_updatev walks it in place
+
+typedef enum {
+    CHECKSUM_SIMPLE,
+    CHECKSUM_XOR,
+    CHECKSUM_FLETCHER16,
+    CHECKSUM_FLETCHER32,
+    CHECKSUM_ADLER32,
+    CHECKSUM_CRC32,
+    CHECKSUM_CRC32C,
+    CHECKSUM_ALGO_COUNT
+} ChecksumAlgo;
+
+typedef struct {
+    ChecksumAlgo algo;
+    uint32_t value; // ... the checksum of everything so far
+    uint64_t length; // ... bytes so far
+    int has_odd_byte; // ... Fletcher-32 only: a fragment ended halfway through a word
+    uint8_t odd_byte;
+} ChecksumCtx;
+
+const char *checksum_name(ChecksumAlgo algo) {
+    switch (algo) {
+        case CHECKSUM_SIMPLE: return "Simple";
+        case CHECKSUM_XOR: return "XOR";
+        case CHECKSUM_FLETCHER16: return "Fletcher-16";
+        case CHECKSUM_FLETCHER32: return "Fletcher-32";
+        case CHECKSUM_ADLER32: return "Adler-32";
+        case CHECKSUM_CRC32: return "CRC-32";
+        case CHECKSUM_CRC32C: return "CRC-32C";
+        default: return "unknown";
+    }
+}
+
+void checksum_init(ChecksumCtx *ctx, ChecksumAlgo algo) {
+    ctx->algo = algo;
+    ctx->value = algo == CHECKSUM_ADLER32 ? 1 : 0;
+    ctx->length = 0;
+    ctx->has_odd_byte = 0;
+    ctx->odd_byte = 0;
+}
+
+void checksum_update(ChecksumCtx *ctx, const uint8_t *data, size_t len) {
+    ctx->length += len;
+
+    switch (ctx->algo) {
+        case CHECKSUM_SIMPLE:
+            ctx->value = simple_checksum_combine((uint8_t)ctx->value, simple_checksum(data, len));
+            break;
+        case CHECKSUM_XOR:
+            ctx->value = xor_checksum_combine((uint8_t)ctx->value, xor_checksum(data, len));
+            break;
+        case CHECKSUM_FLETCHER16:
+            ctx->value = fletcher16_update((uint16_t)ctx->value, data, len);
+            break;
+        case CHECKSUM_FLETCHER32:
+            // finish a word left half done by the last fragment
+            if (ctx->has_odd_byte && len > 0) {
+                uint8_t word[2] = { ctx->odd_byte, data[0] };
+                ctx->value = fletcher32_update(ctx->value, word, 2);
+                ctx->has_odd_byte = 0;
+                data++;
+                len--;
+            }
+            // and hold back this fragment's last byte if it splits a word
+            if (len & 1) {
+                ctx->odd_byte = data[len - 1];
+                ctx->has_odd_byte = 1;
+                len--;
+            }
+            ctx->value = fletcher32_update(ctx->value, data, len);
+            break;
+        case CHECKSUM_ADLER32:
+            ctx->value = adler32_update(ctx->value, data, len);
+            break;
+        case CHECKSUM_CRC32:
+            ctx->value = crc32_ieee_update(ctx->value, data, len);
+            break;
+        case CHECKSUM_CRC32C:
+            ctx->value = crc32c_update(ctx->value, data, len);
+            break;
+        default:
+            break;
+    }
+}
+
+// scatter-gather: every buffer in the iovec, in order, as if back to back
+void checksum_updatev(ChecksumCtx *ctx, const struct iovec *iov, int iovcnt) {
+    for (int i = 0; i < iovcnt; i++) {
+        checksum_update(ctx, (const uint8_t *)iov[i].iov_base, iov[i].iov_len);
+    }
+}
+
+// the result, widened to 32 bits. the context can keep being updated after
+uint32_t checksum_final(const ChecksumCtx *ctx) {
+    if (ctx->algo == CHECKSUM_FLETCHER32 && ctx->has_odd_byte) {
+        // the message ended on a half word - pad it with a zero byte
+        return fletcher32_update(ctx->value, &ctx->odd_byte, 1);
+    }
+    return ctx->value;
+}
+
+// one-shot checksum of a whole iovec
+uint32_t checksum_iov(ChecksumAlgo algo, const struct iovec *iov, int iovcnt) {
+    ChecksumCtx ctx;
+    checksum_init(&ctx, algo);
+    checksum_updatev(&ctx, iov, iovcnt);
+    return checksum_final(&ctx);
+}
+
+// one-shot checksum of a single buffer, for callers that pick the algorithm
+// at run time
+uint32_t checksum(ChecksumAlgo algo, const uint8_t *data, size_t len) {
+    ChecksumCtx ctx;
+    checksum_init(&ctx, algo);
+    checksum_update(&ctx, data, len);
+    return checksum_final(&ctx);
+}
+
+// ========== Fused engine kernels ==========
+// multi_digest.h runs every selected checksum over one L1-sized block before
+// moving on. with its portable loops that loses to this file's kernels doing
+// one pass each, so it gets the same kernels the separate functions use
+
+// CRC-32 on the raw (pre-inverted) state, as the engine keeps it
+uint32_t crc32_ieee_state(uint32_t state, const uint8_t *data, size_t len) {
+    return crc32_ieee_algo.kernel(&crc32_ieee_algo, state, data, len);
+}
+
+MultiDigestKernels fast_digest_kernels;
+
+// hands the engine the kernels each family's init picked - call before any
+// thread uses it
+void multi_digest_use_fast_kernels(void) {
+    byte_ops_init();
+    sums_init();
+    crc_init();
+
+    fast_digest_kernels.sum = byte_ops_kernel->sum;
+    fast_digest_kernels.xor_fn = byte_ops_kernel->xor_fn;
+    fast_digest_kernels.fletcher = sums_kernel->bytes;
+    fast_digest_kernels.crc32 = crc32_ieee_state;
+    multi_digest_kernels = &fast_digest_kernels;
+}
+
+// ========== Benchmark mode ==========
+// ./simple_checksum --bench [--bench-sizes=16,4K,1M] [--bench-max=256M] [--csv=out.csv]
+// runs every algorithm with every kernel this CPU has, over buffer sizes
+// from 16 B up (powers of 4), from an aligned and an unaligned start, with
+// the buffer in cache (hot) and flushed out of it before each run (cold)
+
+#define BENCH_MAX_SIZES 32
+#define BENCH_TARGET_BYTES (64ull * 1024 * 1024) // ... roughly how much each measurement reads
+#define BENCH_MAX_COLD_RUNS 4096 // ... flushing is slow, so cold runs are capped
+#define BENCH_UNALIGNED_OFFSET 1
+#define BENCH_MAX_KERNELS 8 // ... more than any one family has
+
+typedef struct {
+    size_t sizes[BENCH_MAX_SIZES];
+    int num_sizes;
+    const char *csv_path;
+} BenchConfig;
+
+typedef struct {
+    ChecksumAlgo algo;
+    const char *kernel;
+    size_t size;
+    int unaligned;
+    int cold;
+    uint64_t runs;
+    double seconds;
+    double gbps;
+    double cycles_per_byte;
+    uint32_t result; // ... kept so the runs can't be optimised away
+} BenchResult;
+
+double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// time stamp counter - counts at a fixed rate, so with turbo or power saving
+// these are reference cycles rather than core cycles. without one, nanoseconds
+uint64_t read_cycles(void) {
+#ifdef HAVE_X86_KERNELS
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#endif
+}
+
+// how fast read_cycles counts, so cold runs can be timed with it alone -
+// a clock_gettime around each tiny run would cost more than the run
+double bench_cycles_per_second = 0;
+
+void calibrate_cycles(void) {
+    double start = now_seconds();
+    uint64_t c0 = read_cycles();
+    while (now_seconds() - start < 0.05) {
+        // spin for 50 ms
+    }
+    bench_cycles_per_second = (read_cycles() - c0) / (now_seconds() - start);
+}
+
+// pushes the buffer out of every cache level, so the next read comes from memory
+void evict_from_cache(const uint8_t *data, size_t len, uint8_t *scratch, size_t scratch_len) {
+#ifdef HAVE_X86_KERNELS
+    (void)scratch;
+    (void)scratch_len;
+    for (size_t i = 0; i < len; i += 64) {
+        _mm_clflush(data + i);
+    }
+    _mm_clflush(data + len - 1);
+    _mm_mfence();
+#else
+    // no flush instruction - write over something bigger than the caches instead
+    (void)data;
+    (void)len;
+    for (size_t i = 0; i < scratch_len; i += 64) {
+        scratch[i]++;
+    }
+#endif
+}
+
+// points `algo` at kernel number k of its family. returns 0 if there is no
+// such kernel, or this CPU can't run it
+int bench_use_kernel(ChecksumAlgo algo, size_t k, const char **name) {
+    switch (algo) {
+        case CHECKSUM_SIMPLE:
+        case CHECKSUM_XOR:
+            if (k >= BYTE_OPS_KERNEL_COUNT || !byte_ops_kernels[k].available) {
+                return 0;
+            }
+            byte_ops_kernel = &byte_ops_kernels[k];
+            *name = byte_ops_kernels[k].name;
+            return 1;
+        case CHECKSUM_FLETCHER16:
+        case CHECKSUM_FLETCHER32:
+        case CHECKSUM_ADLER32:
+            if (k >= SUMS_KERNEL_COUNT || !sums_kernels[k].available) {
+                return 0;
+            }
+            sums_kernel = &sums_kernels[k];
+            *name = sums_kernels[k].name;
+            return 1;
+        case CHECKSUM_CRC32:
+        case CHECKSUM_CRC32C: {
+            CrcAlgo *crc = algo == CHECKSUM_CRC32 ? &crc32_ieee_algo : &crc32c_algo;
+            if (k >= CRC_KERNEL_COUNT || !crc_kernels[k].available ||
+                (crc_kernels[k].only_poly != 0 && crc_kernels[k].only_poly != crc->poly)) {
+                return 0;
+            }
+            crc->kernel = crc_kernels[k].fn;
+            *name = crc_kernels[k].name;
+            return 1;
+        }
+        default:
+            return 0;
+    }
+}
+
+// back to what each family's init would pick - only with no other thread
+// running, as the inits are run again from scratch
+void bench_reset_kernels(void) {
+    byte_ops_state = 0;
+    sums_state = 0;
+    crc_state = 0;
+    byte_ops_init();
+    sums_init();
+    crc_init();
+}
+
+// times one algorithm and kernel on one buffer, hot or cold
+void bench_measure(BenchResult *r, const uint8_t *data, uint8_t *scratch, size_t scratch_len) {
+    uint64_t runs = BENCH_TARGET_BYTES / r->size;
+    if (runs == 0) {
+        runs = 1;
+    }
+    if (r->cold && runs > BENCH_MAX_COLD_RUNS) {
+        runs = BENCH_MAX_COLD_RUNS;
+    }
+
+    uint32_t result = 0;
+    uint64_t cycles = 0;
+    double seconds = 0;
+
+    if (r->cold) {
+        // flush, then time just the checksum - one run at a time
+        for (uint64_t i = 0; i < runs; i++) {
+            evict_from_cache(data, r->size, scratch, scratch_len);
+            uint64_t c0 = read_cycles();
+            result ^= checksum(r->algo, data, r->size);
+            cycles += read_cycles() - c0;
+        }
+        seconds = cycles / bench_cycles_per_second;
+    } else {
+        // one untimed run to pull it into cache, then all the runs in one go
+        result = checksum(r->algo, data, r->size);
+        double start = now_seconds();
+        uint64_t c0 = read_cycles();
+        for (uint64_t i = 0; i < runs; i++) {
+            result ^= checksum(r->algo, data, r->size);
+        }
+        cycles = read_cycles() - c0;
+        seconds = now_seconds() - start;
+    }
+
+    double bytes = (double)runs * r->size;
+    r->runs = runs;
+    r->seconds = seconds;
+    r->gbps = seconds > 0 ? bytes / seconds / 1e9 : 0.0;
+    r->cycles_per_byte = cycles / bytes;
+    r->result = result;
+}
+
+void write_bench_csv(const char *path, const BenchResult *results, int count) {
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL) {
+        printf("Error: Cannot write '%s'\n", path);
+        return;
+    }
+
+    fprintf(fp, "algorithm,kernel,size_bytes,alignment,cache,runs,seconds,gb_per_s,cycles_per_byte\n");
+    for (int i = 0; i < count; i++) {
+        fprintf(fp, "%s,%s,%zu,%s,%s,%llu,%.6f,%.3f,%.4f\n", checksum_name(results[i].algo),
+                results[i].kernel, results[i].size, results[i].unaligned ? "unaligned" : "aligned",
+                results[i].cold ? "cold" : "hot", (unsigned long long)results[i].runs,
+                results[i].seconds, results[i].gbps, results[i].cycles_per_byte);
+    }
+
+    fclose(fp);
+}
+
+int run_benchmark(const BenchConfig *bench) {
+    size_t max_size = 0;
+    for (int i = 0; i < bench->num_sizes; i++) {
+        if (bench->sizes[i] > max_size) {
+            max_size = bench->sizes[i];
+        }
+    }
+
+    // 64-byte aligned, with room for the unaligned start
+    uint8_t *buffer = aligned_alloc(64, (max_size + 64 + 63) / 64 * 64);
+    if (buffer == NULL) {
+        printf("Error: Cannot allocate %zu bytes for the benchmark\n", max_size + 64);
+        return 1;
+    }
+    for (size_t i = 0; i < max_size + 64; i++) {
+        buffer[i] = (uint8_t)(i * 2654435761u >> 13);
+    }
+
+    size_t scratch_len = 0;
+    uint8_t *scratch = NULL;
+#ifndef HAVE_X86_KERNELS
+    scratch_len = 64 * 1024 * 1024;
+    scratch = calloc(scratch_len, 1);
+    if (scratch == NULL) {
+        printf("Error: out of memory\n");
+        free(buffer);
+        return 1;
+    }
+#endif
+
+    int capacity = CHECKSUM_ALGO_COUNT * BENCH_MAX_KERNELS * bench->num_sizes * 4;
+    BenchResult *results = malloc(capacity * sizeof(BenchResult));
+    if (results == NULL) {
+        printf("Error: out of memory\n");
+        free(scratch);
+        free(buffer);
+        return 1;
+    }
+    int count = 0;
+
+    bench_reset_kernels();
+    calibrate_cycles();
+    printf("Cycle counter: %.2f GHz\n\n", bench_cycles_per_second / 1e9);
+    printf("%-12s %-10s %10s %-9s %-4s %9s %10s\n",
+           "algorithm", "kernel", "size", "alignment", "cache", "GB/s", "cycles/B");
+
+    for (int algo = 0; algo < CHECKSUM_ALGO_COUNT; algo++) {
+        for (size_t k = 0; k < BENCH_MAX_KERNELS; k++) {
+            const char *kernel_name;
+            if (!bench_use_kernel((ChecksumAlgo)algo, k, &kernel_name)) {
+                continue;
+            }
+
+            for (int s = 0; s < bench->num_sizes; s++) {
+                for (int unaligned = 0; unaligned < 2; unaligned++) {
+                    for (int cold = 0; cold < 2; cold++) {
+                        BenchResult *r = &results[count++];
+                        r->algo = (ChecksumAlgo)algo;
+                        r->kernel = kernel_name;
+                        r->size = bench->sizes[s];
+                        r->unaligned = unaligned;
+                        r->cold = cold;
+
+                        bench_measure(r, buffer + (unaligned ? BENCH_UNALIGNED_OFFSET : 0),
+                                      scratch, scratch_len);
+
+                        printf("%-12s %-10s %10zu %-9s %-4s %9.2f %10.3f\n",
+                               checksum_name(r->algo), r->kernel, r->size,
+                               unaligned ? "unaligned" : "aligned", cold ? "cold" : "hot",
+                               r->gbps, r->cycles_per_byte);
+                    }
+                }
+            }
+        }
+        bench_reset_kernels();
+    }
+
+    if (bench->csv_path != NULL) {
+        write_bench_csv(bench->csv_path, results, count);
+        printf("\nWrote %d results to %s\n", count, bench->csv_path);
+    }
+
+    free(results);
+    free(scratch);
+    free(buffer);
+    return 0;
+}
+
+// parses a byte count with an optional K, M or G suffix - returns 0 if invalid
+size_t parse_size(const char *text) {
+    char *end;
+    unsigned long long value = strtoull(text, &end, 10);
+
+    if (end == text) {
+        return 0;
+    }
+
+    if (*end == 'K' || *end == 'k') {
+        value *= 1024ULL;
+        end++;
+    } else if (*end == 'M' || *end == 'm') {
+        value *= 1024ULL * 1024;
+        end++;
+    } else if (*end == 'G' || *end == 'g') {
+        value *= 1024ULL * 1024 * 1024;
+        end++;
+    }
+
+    if (*end != '\0') {
+        return 0;
+    }
+
+    return (size_t)value;
+}
+
+int main(int argc, char *argv[]) {
+    // --bench skips the tests and times every kernel instead
+    BenchConfig bench = { .num_sizes = 0, .csv_path = NULL };
+    size_t bench_max = 1024ull * 1024 * 1024;
+    int use_bench = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--bench") == 0) {
+            use_bench = 1;
+        } else if (strncmp(argv[i], "--bench-sizes=", 14) == 0) {
+            for (char *item = strtok(argv[i] + 14, ","); item != NULL; item = strtok(NULL, ",")) {
+                if (bench.num_sizes == BENCH_MAX_SIZES || parse_size(item) == 0) {
+                    printf("Error: Invalid benchmark size '%s'\n", item);
+                    return 1;
+                }
+                bench.sizes[bench.num_sizes++] = parse_size(item);
+            }
+        } else if (strncmp(argv[i], "--bench-max=", 12) == 0) {
+            bench_max = parse_size(argv[i] + 12);
+            if (bench_max < 16) {
+                printf("Error: Invalid benchmark size '%s'\n", argv[i] + 12);
+                return 1;
+            }
+        } else if (strncmp(argv[i], "--csv=", 6) == 0) {
+            bench.csv_path = argv[i] + 6;
+        } else {
+            printf("Error: Unknown option '%s'\n", argv[i]);
+            printf("Usage: %s [--bench] [--bench-sizes=16,4K,1M] [--bench-max=1G] [--csv=file]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (use_bench) {
+        // 16 B, 64 B, 256 B ... up to the max
+        if (bench.num_sizes == 0) {
+            for (size_t size = 16; size <= bench_max && bench.num_sizes < BENCH_MAX_SIZES; size *= 4) {
+                bench.sizes[bench.num_sizes++] = size;
+            }
+        }
+        return run_benchmark(&bench);
+    }
+
     // Test message
     const char *message = "Mission data: coordinates 12.34, -56.78";
     size_t len = strlen(message);
@@ -230,6 +1650,484 @@ int main() {
     printf("  XOR: %u\n", xor_checksum(all_ff, 5));
     printf("  Fletcher-16: %u\n\n", fletcher16(all_ff, 5));
     
+    // ========== TEST 6: Fused single pass ==========
+    printf("--- Test 6: All Checksums in One Pass ---\n");
+
+    MultiDigest md;
+    multi_digest_init(&md, DIGEST_ALL);
+    multi_digest_update(&md, (uint8_t*)message, len);
+
+    int fused_ok = multi_digest_simple(&md) == simple_orig &&
+                   md.xor_value == xor_orig &&
+                   multi_digest_fletcher16(&md) == fletcher_orig;
+    printf("Fused: Simple=%u, XOR=%u, Fletcher=%u, CRC-32=%08x\n",
+           multi_digest_simple(&md), md.xor_value, multi_digest_fletcher16(&md),
+           multi_digest_crc32(&md));
+
+    // a bigger buffer, so one pass vs three passes shows up in the timing
+    size_t big_len = 64 * 1024 * 1024;
+    uint8_t *big = malloc(big_len);
+    if (big == NULL) {
+        printf("Error: out of memory\n");
+        return 1;
+    }
+    for (size_t i = 0; i < big_len; i++) {
+        big[i] = (uint8_t)(i * 2654435761u >> 13);
+    }
+
+    unsigned four = DIGEST_SIMPLE | DIGEST_XOR | DIGEST_FLETCHER16 | DIGEST_CRC32;
+
+    clock_t start = clock();
+    uint8_t big_simple = simple_checksum(big, big_len);
+    uint8_t big_xor = xor_checksum(big, big_len);
+    uint16_t big_fletcher = fletcher16(big, big_len);
+    uint32_t big_crc = crc32_ieee(big, big_len);
+    double separate_time = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+    // the baseline: the engine's own portable loops (mt_file_hasher.c plugs in
+    // its hash_chunk kernel for the sum, much as this file does below)
+    start = clock();
+    multi_digest_init(&md, four);
+    multi_digest_update(&md, big, big_len);
+    double portable_time = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+    fused_ok = fused_ok && multi_digest_simple(&md) == big_simple &&
+               md.xor_value == big_xor && multi_digest_fletcher16(&md) == big_fletcher &&
+               multi_digest_crc32(&md) == big_crc;
+
+    // and with the kernels above plugged in
+    multi_digest_use_fast_kernels();
+    start = clock();
+    multi_digest_init(&md, four);
+    multi_digest_update(&md, big, big_len);
+    double fused_time = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+    fused_ok = fused_ok && multi_digest_simple(&md) == big_simple &&
+               md.xor_value == big_xor && multi_digest_fletcher16(&md) == big_fletcher &&
+               multi_digest_crc32(&md) == big_crc;
+    free(big);
+
+    printf("64 MiB, four checksums: %.3f s in separate passes, %.3f s fused "
+           "(%.3f s with the portable loops)\n", separate_time, fused_time, portable_time);
+
+    if (fused_ok) {
+        printf("✓ Fused results match the separate functions\n\n");
+    } else {
+        printf("✗ Fused results DIFFER from the separate functions\n\n");
+    }
+
+    // ========== TEST 7: CRC-32 and CRC-32C ==========
+    printf("--- Test 7: CRC-32 and CRC-32C ---\n");
+
+    crc_init();
+    printf("Kernels picked: CRC-32 = %s, CRC-32C = %s\n",
+           crc_kernel_name(crc32_ieee_algo.kernel), crc_kernel_name(crc32c_algo.kernel));
+
+    // the standard check value for both is the CRC of "123456789"
+    const uint8_t *check = (const uint8_t*)"123456789";
+    uint32_t check_ieee = crc32_ieee(check, 9);
+    uint32_t check_c = crc32c(check, 9);
+    printf("CRC-32(\"123456789\")  = %08x (expect cbf43926)\n", check_ieee);
+    printf("CRC-32C(\"123456789\") = %08x (expect e3069283)\n", check_c);
+    printf("Original message: CRC-32=%08x, CRC-32C=%08x\n",
+           crc32_ieee((uint8_t*)message, len), crc32c((uint8_t*)message, len));
+    printf("Corrupted message: CRC-32=%08x, CRC-32C=%08x\n",
+           crc32_ieee((uint8_t*)corrupted, len), crc32c((uint8_t*)corrupted, len));
+    printf("Swapped message: CRC-32=%08x, CRC-32C=%08x\n",
+           crc32_ieee((uint8_t*)swapped, len), crc32c((uint8_t*)swapped, len));
+
+    // and CRC-32 has to agree with the fused engine's own slice-by-8 one
+    multi_digest_kernels = &multi_digest_portable_kernels;
+    multi_digest_init(&md, DIGEST_CRC32);
+    multi_digest_update(&md, (uint8_t*)message, len);
+    multi_digest_kernels = &fast_digest_kernels;
+    int crc_ok = check_ieee == 0xCBF43926u && check_c == 0xE3069283u &&
+                 crc32_ieee((uint8_t*)message, len) == multi_digest_crc32(&md);
+
+    // every kernel against the bytewise one, over odd lengths and offsets so
+    // the alignment and tail handling get exercised
+    size_t crc_len = 64 * 1024 * 1024;
+    uint8_t *crc_buf = malloc(crc_len + 64);
+    if (crc_buf == NULL) {
+        printf("Error: out of memory\n");
+        return 1;
+    }
+    for (size_t i = 0; i < crc_len + 64; i++) {
+        crc_buf[i] = (uint8_t)(i * 2654435761u >> 13);
+    }
+
+    CrcAlgo *algos[2] = { &crc32_ieee_algo, &crc32c_algo };
+    for (int a = 0; a < 2; a++) {
+        for (size_t k = 0; k < CRC_KERNEL_COUNT; k++) {
+            CrcKernel *kernel = &crc_kernels[k];
+            if (!kernel->available || (kernel->only_poly != 0 && kernel->only_poly != algos[a]->poly)) {
+                continue;
+            }
+
+            for (size_t n = 0; n < 2000; n += 1 + n / 8) {
+                for (size_t offset = 0; offset < 16; offset += 5) {
+                    uint32_t want = crc_bytewise(algos[a], 0xFFFFFFFFu, crc_buf + offset, n);
+                    uint32_t got = kernel->fn(algos[a], 0xFFFFFFFFu, crc_buf + offset, n);
+                    if (want != got) {
+                        printf("✗ %s %s kernel wrong at length %zu, offset %zu\n",
+                               algos[a]->name, kernel->name, n, offset);
+                        crc_ok = 0;
+                    }
+                }
+            }
+        }
+    }
+
+    // throughput of each kernel over 64 MiB
+    for (int a = 0; a < 2; a++) {
+        uint32_t reference = 0;
+        for (size_t k = 0; k < CRC_KERNEL_COUNT; k++) {
+            CrcKernel *kernel = &crc_kernels[k];
+            if (!kernel->available || (kernel->only_poly != 0 && kernel->only_poly != algos[a]->poly)) {
+                continue;
+            }
+
+            start = clock();
+            uint32_t result = kernel->fn(algos[a], 0xFFFFFFFFu, crc_buf, crc_len) ^ 0xFFFFFFFFu;
+            double seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+            if (k == 0) {
+                reference = result;
+            } else if (result != reference) {
+                crc_ok = 0;
+            }
+
+            printf("64 MiB %-7s %-10s: %08x  %6.2f GB/s\n", algos[a]->name, kernel->name, result,
+                   seconds > 0 ? crc_len / seconds / 1e9 : 0.0);
+        }
+    }
+    free(crc_buf);
+
+    if (crc_ok) {
+        printf("✓ Every CRC kernel matches the reference\n\n");
+    } else {
+        printf("✗ CRC kernels DISAGREE\n\n");
+    }
+
+    // ========== TEST 8: Fletcher-16, Fletcher-32 and Adler-32 ==========
+    printf("--- Test 8: Fletcher and Adler Block Sums ---\n");
+
+    sums_init();
+    printf("Kernel picked: %s\n", sums_kernel->name);
+    printf("Fletcher-16(message) = %u (bytewise %u)\n",
+           fletcher16((uint8_t*)message, len), fletcher16_bytewise((uint8_t*)message, len));
+    printf("Fletcher-32(\"abcde\")  = %08x (expect f04fc729)\n", fletcher32((uint8_t*)"abcde", 5));
+    printf("Fletcher-32(\"abcdef\") = %08x (expect 56502d2a)\n", fletcher32((uint8_t*)"abcdef", 6));
+    printf("Adler-32(\"Wikipedia\") = %08x (expect 11e60398)\n", adler32((uint8_t*)"Wikipedia", 9));
+
+    int sums_ok = fletcher16((uint8_t*)message, len) == fletcher_orig &&
+                  fletcher32((uint8_t*)"abcde", 5) == 0xF04FC729u &&
+                  fletcher32((uint8_t*)"abcdef", 6) == 0x56502D2Au &&
+                  adler32((uint8_t*)"Wikipedia", 9) == 0x11E60398u;
+
+    // all 0xFF is the worst case for overflow, so test that as well as
+    // ordinary data, over lengths either side of the block sizes
+    size_t sums_len = 64 * 1024 * 1024;
+    uint8_t *sums_buf = malloc(sums_len + 64);
+    if (sums_buf == NULL) {
+        printf("Error: out of memory\n");
+        return 1;
+    }
+
+    size_t test_lengths[] = { 0, 1, 2, 31, 32, 33, 255, 256, 717, 718, 719, 1000,
+                              5551, 5552, 5553, 5801, 5802, 5803, 20000, 70001 };
+    size_t test_count = sizeof(test_lengths) / sizeof(test_lengths[0]);
+
+    for (int fill = 0; fill < 2; fill++) {
+        for (size_t i = 0; i < 70001 + 64; i++) {
+            sums_buf[i] = fill == 0 ? 0xFF : (uint8_t)(i * 2654435761u >> 13);
+        }
+
+        for (size_t k = 0; k < SUMS_KERNEL_COUNT; k++) {
+            if (!sums_kernels[k].available) {
+                continue;
+            }
+            sums_kernel = &sums_kernels[k];
+
+            for (size_t t = 0; t < test_count; t++) {
+                for (size_t offset = 0; offset < 8; offset += 3) {
+                    const uint8_t *p = sums_buf + offset;
+                    size_t n = test_lengths[t];
+                    if (fletcher16(p, n) != fletcher16_bytewise(p, n) ||
+                        fletcher32(p, n) != fletcher32_bytewise(p, n) ||
+                        adler32(p, n) != adler32_bytewise(p, n)) {
+                        printf("✗ %s kernel wrong at length %zu, offset %zu, %s data\n",
+                               sums_kernels[k].name, n, offset, fill == 0 ? "0xFF" : "mixed");
+                        sums_ok = 0;
+                    }
+                }
+            }
+        }
+    }
+
+    // throughput over 64 MiB: the bytewise originals, then each kernel
+    for (size_t i = 0; i < sums_len; i++) {
+        sums_buf[i] = (uint8_t)(i * 2654435761u >> 13);
+    }
+
+    start = clock();
+    uint16_t want16 = fletcher16_bytewise(sums_buf, sums_len);
+    double seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+    printf("64 MiB Fletcher-16 bytewise: %.2f GB/s\n", seconds > 0 ? sums_len / seconds / 1e9 : 0.0);
+
+    start = clock();
+    uint32_t want32 = fletcher32_bytewise(sums_buf, sums_len);
+    seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+    printf("64 MiB Fletcher-32 bytewise: %.2f GB/s\n", seconds > 0 ? sums_len / seconds / 1e9 : 0.0);
+
+    start = clock();
+    uint32_t want_adler = adler32_bytewise(sums_buf, sums_len);
+    seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+    printf("64 MiB Adler-32 bytewise:    %.2f GB/s\n", seconds > 0 ? sums_len / seconds / 1e9 : 0.0);
+
+    for (size_t k = 0; k < SUMS_KERNEL_COUNT; k++) {
+        if (!sums_kernels[k].available) {
+            continue;
+        }
+        sums_kernel = &sums_kernels[k];
+
+        start = clock();
+        sums_ok = sums_ok && fletcher16(sums_buf, sums_len) == want16;
+        double f16_time = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+        start = clock();
+        sums_ok = sums_ok && fletcher32(sums_buf, sums_len) == want32;
+        double f32_time = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+        start = clock();
+        sums_ok = sums_ok && adler32(sums_buf, sums_len) == want_adler;
+        double adler_time = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+        printf("64 MiB %-6s: Fletcher-16 %.2f GB/s, Fletcher-32 %.2f GB/s, Adler-32 %.2f GB/s\n",
+               sums_kernels[k].name,
+               f16_time > 0 ? sums_len / f16_time / 1e9 : 0.0,
+               f32_time > 0 ? sums_len / f32_time / 1e9 : 0.0,
+               adler_time > 0 ? sums_len / adler_time / 1e9 : 0.0);
+    }
+    free(sums_buf);
+
+    // back to the best one for anything after this
+    sums_state = 0;
+    sums_kernel = &sums_kernels[0];
+    sums_init();
+
+    if (sums_ok) {
+        printf("✓ Block sums match the bytewise versions\n\n");
+    } else {
+        printf("✗ Block sums DIFFER from the bytewise versions\n\n");
+    }
+
+    // ========== TEST 9: Combining pieces checksummed out of order ==========
+    printf("--- Test 9: Combining Out-of-Order Pieces ---\n");
+
+    // uneven pieces (all even lengths but the last, for Fletcher-32), some empty
+    size_t piece_lengths[] = { 4096, 0, 1000000, 2, 65536, 5802, 123456, 0, 7777777 };
+    int piece_count = sizeof(piece_lengths) / sizeof(piece_lengths[0]);
+    size_t whole_len = 0;
+    for (int i = 0; i < piece_count; i++) {
+        whole_len += piece_lengths[i];
+    }
+
+    uint8_t *whole = malloc(whole_len);
+    if (whole == NULL) {
+        printf("Error: out of memory\n");
+        return 1;
+    }
+    for (size_t i = 0; i < whole_len; i++) {
+        whole[i] = (uint8_t)(i * 2654435761u >> 13);
+    }
+
+    // checksum the pieces last to first, the way they might arrive
+    typedef struct {
+        uint8_t simple, xor_value;
+        uint16_t fletcher16;
+        uint32_t fletcher32, adler32, crc32, crc32c;
+    } PieceSums;
+    PieceSums pieces[9];
+
+    for (int i = piece_count - 1; i >= 0; i--) {
+        size_t offset = 0;
+        for (int j = 0; j < i; j++) {
+            offset += piece_lengths[j];
+        }
+        const uint8_t *p = whole + offset;
+        size_t n = piece_lengths[i];
+
+        pieces[i].simple = simple_checksum(p, n);
+        pieces[i].xor_value = xor_checksum(p, n);
+        pieces[i].fletcher16 = fletcher16(p, n);
+        pieces[i].fletcher32 = fletcher32(p, n);
+        pieces[i].adler32 = adler32(p, n);
+        pieces[i].crc32 = crc32_ieee(p, n);
+        pieces[i].crc32c = crc32c(p, n);
+    }
+
+    // then merge them front to back
+    PieceSums merged = pieces[0];
+    for (int i = 1; i < piece_count; i++) {
+        uint64_t n = piece_lengths[i];
+        merged.simple = simple_checksum_combine(merged.simple, pieces[i].simple);
+        merged.xor_value = xor_checksum_combine(merged.xor_value, pieces[i].xor_value);
+        merged.fletcher16 = fletcher16_combine(merged.fletcher16, pieces[i].fletcher16, n);
+        merged.fletcher32 = fletcher32_combine(merged.fletcher32, pieces[i].fletcher32, n);
+        merged.adler32 = adler32_combine(merged.adler32, pieces[i].adler32, n);
+        merged.crc32 = crc32_ieee_combine(merged.crc32, pieces[i].crc32, n);
+        merged.crc32c = crc32c_combine(merged.crc32c, pieces[i].crc32c, n);
+    }
+
+    int combine_ok = 1;
+    combine_ok &= merged.simple == simple_checksum(whole, whole_len);
+    combine_ok &= merged.xor_value == xor_checksum(whole, whole_len);
+    combine_ok &= merged.fletcher16 == fletcher16(whole, whole_len);
+    combine_ok &= merged.fletcher32 == fletcher32(whole, whole_len);
+    combine_ok &= merged.adler32 == adler32(whole, whole_len);
+    combine_ok &= merged.crc32 == crc32_ieee(whole, whole_len);
+    combine_ok &= merged.crc32c == crc32c(whole, whole_len);
+    free(whole);
+
+    printf("%d pieces, %zu bytes: Fletcher-16=%u, Fletcher-32=%08x, Adler-32=%08x,\n",
+           piece_count, whole_len, merged.fletcher16, merged.fletcher32, merged.adler32);
+    printf("  CRC-32=%08x, CRC-32C=%08x\n", merged.crc32, merged.crc32c);
+
+    if (combine_ok) {
+        printf("✓ Combined pieces match one pass over the whole buffer\n\n");
+    } else {
+        printf("✗ Combined pieces DIFFER from one pass over the whole buffer\n\n");
+    }
+
+    // ========== TEST 10: Streaming contexts and scatter-gather ==========
+    printf("--- Test 10: Fragmented Messages ---\n");
+
+    // the message as a header, a body and a trailer in three separate buffers
+    struct iovec parts[3] = {
+        { (void*)message, 13 }, // ... "Mission data:"
+        { (void*)(message + 13), 14 },
+        { (void*)(message + 27), len - 27 },
+    };
+
+    int stream_ok = 1;
+    for (int algo = 0; algo < CHECKSUM_ALGO_COUNT; algo++) {
+        uint32_t whole_sum = checksum((ChecksumAlgo)algo, (uint8_t*)message, len);
+        uint32_t iov_sum = checksum_iov((ChecksumAlgo)algo, parts, 3);
+        printf("%-12s whole=%08x iovec=%08x\n", checksum_name((ChecksumAlgo)algo), whole_sum, iov_sum);
+        stream_ok = stream_ok && whole_sum == iov_sum;
+    }
+    stream_ok = stream_ok && checksum(CHECKSUM_FLETCHER16, (uint8_t*)message, len) == fletcher_orig &&
+                checksum(CHECKSUM_CRC32, (uint8_t*)message, len) == crc32_ieee((uint8_t*)message, len);
+
+    // and a bigger buffer fed in fragments of every odd and even size, so
+    // Fletcher-32 words get split across fragments
+    size_t frag_len = 3 * 1024 * 1024 + 7;
+    uint8_t *frag_buf = malloc(frag_len);
+    if (frag_buf == NULL) {
+        printf("Error: out of memory\n");
+        return 1;
+    }
+    for (size_t i = 0; i < frag_len; i++) {
+        frag_buf[i] = (uint8_t)(i * 2654435761u >> 13);
+    }
+
+    for (int algo = 0; algo < CHECKSUM_ALGO_COUNT; algo++) {
+        ChecksumCtx ctx;
+        checksum_init(&ctx, (ChecksumAlgo)algo);
+
+        size_t done = 0;
+        size_t step = 1;
+        while (done < frag_len) {
+            size_t n = frag_len - done < step ? frag_len - done : step;
+            checksum_update(&ctx, frag_buf + done, n);
+            done += n;
+            step = step * 3 + 1 > 100000 ? 1 : step * 3 + 1; // ... 1, 4, 13, 40 ... and round again
+        }
+
+        if (checksum_final(&ctx) != checksum((ChecksumAlgo)algo, frag_buf, frag_len) ||
+            ctx.length != frag_len) {
+            printf("✗ %s gave a different result in fragments\n", checksum_name((ChecksumAlgo)algo));
+            stream_ok = 0;
+        }
+    }
+    free(frag_buf);
+
+    if (stream_ok) {
+        printf("✓ Fragmented and iovec checksums match the whole-buffer ones\n\n");
+    } else {
+        printf("✗ Fragmented checksums DIFFER from the whole-buffer ones\n\n");
+    }
+
+    // ========== TEST 11: Wide simple and XOR checksums ==========
+    printf("--- Test 11: Wide Simple and XOR Checksums ---\n");
+
+    byte_ops_init();
+    printf("Kernel picked: %s\n", byte_ops_kernel->name);
+
+    size_t wide_len = 64 * 1024 * 1024;
+    uint8_t *wide = malloc(wide_len + 64);
+    if (wide == NULL) {
+        printf("Error: out of memory\n");
+        return 1;
+    }
+    for (size_t i = 0; i < wide_len + 64; i++) {
+        wide[i] = (uint8_t)(i * 2654435761u >> 13);
+    }
+
+    int wide_ok = 1;
+    ByteOpsKernel *best = byte_ops_kernel;
+    for (size_t k = 0; k < BYTE_OPS_KERNEL_COUNT; k++) {
+        if (!byte_ops_kernels[k].available) {
+            continue;
+        }
+        byte_ops_kernel = &byte_ops_kernels[k];
+
+        // every length up to a few vectors, at every offset within one
+        for (size_t n = 0; n < 300; n++) {
+            for (size_t offset = 0; offset < 64; offset += 7) {
+                if (simple_checksum(wide + offset, n) != simple_checksum_bytewise(wide + offset, n) ||
+                    xor_checksum(wide + offset, n) != xor_checksum_bytewise(wide + offset, n)) {
+                    printf("✗ %s kernel wrong at length %zu, offset %zu\n",
+                           byte_ops_kernels[k].name, n, offset);
+                    wide_ok = 0;
+                }
+            }
+        }
+    }
+
+    start = clock();
+    uint8_t want_simple = simple_checksum_bytewise(wide, wide_len);
+    uint8_t want_xor = xor_checksum_bytewise(wide, wide_len);
+    seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+    printf("64 MiB bytewise: simple + XOR %.2f GB/s\n", seconds > 0 ? 2 * wide_len / seconds / 1e9 : 0.0);
+
+    for (size_t k = 0; k < BYTE_OPS_KERNEL_COUNT; k++) {
+        if (!byte_ops_kernels[k].available) {
+            continue;
+        }
+        byte_ops_kernel = &byte_ops_kernels[k];
+
+        start = clock();
+        wide_ok = wide_ok && simple_checksum(wide, wide_len) == want_simple;
+        double simple_time = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+        start = clock();
+        wide_ok = wide_ok && xor_checksum(wide, wide_len) == want_xor;
+        double xor_time = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+        printf("64 MiB %-6s: simple %.2f GB/s, XOR %.2f GB/s\n", byte_ops_kernels[k].name,
+               simple_time > 0 ? wide_len / simple_time / 1e9 : 0.0,
+               xor_time > 0 ? wide_len / xor_time / 1e9 : 0.0);
+    }
+    byte_ops_kernel = best;
+    free(wide);
+
+    if (wide_ok) {
+        printf("✓ Wide kernels match the bytewise versions\n\n");
+    } else {
+        printf("✗ Wide kernels DIFFER from the bytewise versions\n\n");
+    }
+
     printf("=== ALL TESTS COMPLETE ===\n");
     
     return 0;
@@ -95,179 +95,4783 @@
 // NOTE -> I have chosen not to use the mutex/semaphore as it is redundant in this problem
 // due to the results all being summed together
 
+#define _GNU_SOURCE // ... O_DIRECT, pthread_setaffinity_np
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <string.h>
 #include <time.h>
 #include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sched.h>
+#include <errno.h>
+#include <dirent.h>
+
+// fused sum/XOR/Fletcher/CRC engine, shared with the checksum challenge
+#include "../../easy/simple-checksum/multi_digest.h"
+
+#if defined(__linux__)
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#if defined(__NR_io_uring_setup)
+#define HAVE_IO_URING 1
+#endif
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS 1
+#endif
+
+// every engine hashes the file as a row of fixed-size leaves and then combines
+// the leaf digests - the leaves never depend on the thread count, so neither
+// does the final digest. chunk sizes are always rounded up to whole leaves
+#define LEAF_SIZE (1024 * 1024)
+
+// streaming engine - the file is read in blocks of this size, and only a few
+// blocks exist at once, so memory use does not depend on the file size
+#define STREAM_BLOCK_SIZE (4 * 1024 * 1024)
+#define LEAVES_PER_BLOCK (STREAM_BLOCK_SIZE / LEAF_SIZE)
+
+// cache-bypass reads - O_DIRECT needs the buffer, offset and length aligned
+// to the device's logical block size; 4K covers every common device
+#define DIRECT_ALIGN 4096
+
+// huge page buffers - the x86-64 huge page size; MAP_HUGETLB lengths are
+// rounded up to it
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+// work stealing - default size of the small chunks handed out to workers
+#define DEFAULT_STEAL_CHUNK_SIZE (2 * 1024 * 1024)
+
+// directory mode - files up to this many bytes are hashed whole by one worker,
+// a batch of them per task; anything bigger is split across the pool
+#define BATCH_MAX_FILES 64
+#define BATCH_MAX_BYTES (8 * 1024 * 1024)
+
+// incremental mode - sidecar index written next to each file
+#define INDEX_SUFFIX ".hidx"
+#define INDEX_MAGIC 0x58444948u // ... "HIDX"
+#define INDEX_VERSION 1
+#define MAX_DIRTY_RANGES 64
+
+// verify mode - leaves handed to a worker at a time; small, so a mismatch
+// stops everyone quickly, but big enough that reads stay mostly sequential
+#define VERIFY_BATCH_LEAVES 4
+
+// content-defined chunking - a cut may fall where the gear hash has its low
+// bits all zero, so chunks average about min + avg bytes. the file is read
+// and cut a window at a time, so memory and the candidate and chunk lists
+// stay small however big the file is
+#define CDC_DEFAULT_AVG (8 * 1024)
+#define CDC_WINDOW_SIZE (64 * 1024 * 1024)
+#define CDC_CHUNK_SEED 3 // ... xxh64 seed for chunk digests
+
+// profiling - spans kept per run (more are counted but dropped), and worker
+// slots (slot 0 is the main/reader thread, slot n is worker n-1)
+#define PROFILE_MAX_EVENTS (64 * 1024)
+#define PROFILE_MAX_THREADS 256
+
+// io_uring backend - reads kept in flight at once, and the size of each read
+// when loading a whole file
+#define URING_QUEUE_DEPTH 32
+#define URING_READ_SIZE (1024 * 1024)
+#define URING_EXTRA_BLOCKS 6 // ... streaming engine: blocks beyond one per worker
+
+// benchmark mode - defaults for --bench
+#define BENCH_MAX_SIZES 8
+#define BENCH_REPEATS 3
+
+// tree mode - a different seed for each kind of node, so a leaf can never be
+// mistaken for an inner node
+#define LEAF_SEED 0
+#define NODE_SEED 1
+#define ROOT_SEED 2
+
+// how the input file gets into memory before it is hashed
+typedef enum {
+    INPUT_READ, // ... malloc a buffer the size of the file and fread into it
+    INPUT_MMAP // ... map the file and hash straight out of the page cache
+} InputMode;
+
+// how bytes are read from disk (mmap mode doesn't read at all)
+typedef enum {
+    IO_SYNC, // ... one blocking read() at a time
+    IO_URING // ... many reads in flight through io_uring, falls back to IO_SYNC
+} IoBackend;
+
+// what happens to the page cache behind the reader
+typedef enum {
+    CACHE_KEEP, // ... normal reads, pages stay cached
+    CACHE_DROP, // ... normal reads, then posix_fadvise(DONTNEED) on what was read
+    CACHE_DIRECT // ... O_DIRECT into aligned blocks, the cache is never touched
+} CacheMode;
+
+// what backs the big buffers (whole-file buffers and streaming blocks)
+typedef enum {
+    PAGES_NORMAL, // ... plain malloc
+    PAGES_THP, // ... anonymous mapping with madvise(MADV_HUGEPAGE)
+    PAGES_HUGETLB // ... MAP_HUGETLB from the reserved pool, falls back to PAGES_THP
+} PageMode;
+
+// what the digest is
+typedef enum {
+    HASH_SUM, // ... sum of all bytes (the original challenge hash)
+    HASH_TREE // ... 64-bit xxHash of each leaf, merged pairwise into a Merkle tree
+} HashMode;
+
+// hasher-wide options - set once from the command line in main
+typedef struct {
+    InputMode input_mode;
+    IoBackend io_backend;
+    CacheMode cache_mode;
+    PageMode page_mode;
+    HashMode hash_mode;
+    int work_stealing; // ... 1 = many small chunks with work stealing, 0 = one slice per thread
+    size_t chunk_size; // ... chunk size for the work stealing scheduler and thread pool
+    int verbose; // ... 0 silences the per-thread progress messages
+    int pin_threads; // ... 1 = pin worker n to the n-th CPU we may run on
+    int first_touch; // ... 1 = each worker reads its own slice (whole-file read mode)
+} HasherConfig;
+
+// one timed stage on one thread - becomes a Chrome trace "X" event
+typedef struct {
+    const char *name;
+    int tid;
+    double start; // ... seconds since the profiler started
+    double end;
+} ProfileEvent;
+
+// what one thread did over the profiled run
+typedef struct {
+    uint64_t bytes; // ... bytes hashed
+    double busy; // ... seconds spent hashing
+    double span; // ... seconds its engine's parallel phase lasted - idle = span - busy
+} ThreadProfile;
+
+typedef struct {
+    int enabled;
+    double origin;
+    ProfileEvent *events;
+    size_t count;
+    size_t dropped; // ... spans that didn't fit in PROFILE_MAX_EVENTS
+    ThreadProfile threads[PROFILE_MAX_THREADS];
+    pthread_mutex_t mutex; // ... protects everything above once enabled
+} Profiler;
+
+Profiler profiler = { .mutex = PTHREAD_MUTEX_INITIALIZER };
+
+// which ThreadProfile slot this thread reports into
+__thread int profile_tid = 0;
+
+HasherConfig config = {
+    .input_mode = INPUT_READ,
+    .io_backend = IO_SYNC,
+    .cache_mode = CACHE_KEEP,
+    .page_mode = PAGES_NORMAL,
+    .hash_mode = HASH_SUM,
+    .work_stealing = 0,
+    .chunk_size = DEFAULT_STEAL_CHUNK_SIZE,
+    .verbose = 1
+};
+
+// the whole file as one block of bytes, however it was loaded
+typedef struct {
+    uint8_t *data; // ... start of the file contents (NULL for an empty file)
+    size_t size; // ... bytes in the file
+    int is_mapped; // ... 1 if data points into a file mapping, 0 if it came from alloc_buffer
+} FileBuffer;
 
 // data structure - each thread needs to know this data
 typedef struct {
-    uint8_t *data; // ... pointer to start of this chunk
+    uint8_t *data; // ... pointer to start of this chunk (always on a leaf boundary)
     size_t size; // ... bytes in this chunk
-    uint64_t hash; // ... outputs result here
+    uint64_t *leaf_hashes; // ... outputs one digest per leaf here
     int thread_id; // ... for debugging if needed
+    int fd; // ... --first-touch: the worker preads its slice from here first
+    uint64_t offset; // ... --first-touch: where the slice starts in the file
+    int failed; // ... --first-touch: set if the read came up short
 } ThreadData;
 
-uint64_t hash_chunk(uint8_t *data, size_t size) {
-    uint64_t hash = 0;
+// one fixed-size piece of the file on its way through the streaming engine
+typedef struct {
+    uint8_t *data; // ... STREAM_BLOCK_SIZE bytes, allocated once and recycled
+    size_t size; // ... bytes actually filled by the reader
+    uint64_t index; // ... position of this block in the file
+} Block;
 
-    for (int i = 0; i < size; i++) {
-        hash += data[i];
+// bounded FIFO of blocks - same mutex/condition variable design as the ring buffer
+typedef struct {
+    Block **items; // fixed-size array
+    int capacity; // max number of blocks
+    int size; // current number of blocks
+    int head; // write position (producer)
+    int tail; // read position (consumer)
+    pthread_mutex_t mutex; // protects queue state
+    pthread_cond_t not_full; // signals when space available
+    pthread_cond_t not_empty; // signals when a block is available
+} BlockQueue;
+
+// leaf digests of a file whose size isn't known up front - grows as blocks
+// are hashed, in whatever order they finish
+typedef struct {
+    uint64_t *hashes;
+    size_t count; // ... one past the highest leaf written so far
+    size_t capacity;
+    int failed; // ... set if growing the array ran out of memory
+    pthread_mutex_t mutex; // ... protects everything above
+} LeafList;
+
+// what each streaming worker needs to know
+typedef struct {
+    BlockQueue *full; // ... blocks waiting to be hashed (NULL means no more data)
+    BlockQueue *free; // ... hashed blocks go back here for the reader to refill
+    LeafList *leaves; // ... every block's leaf digests end up here
+    int thread_id; // ... for debugging if needed
+} StreamWorker;
+
+// one worker's queue of chunk ids - the owner takes from the head (so it walks
+// through its own region in file order), thieves steal from the tail
+typedef struct {
+    size_t *chunks; // ... chunk ids, only [head, tail) are still waiting
+    size_t head;
+    size_t tail;
+    pthread_mutex_t mutex; // ... protects head and tail
+} ChunkDeque;
+
+// what each work stealing worker needs to know
+typedef struct {
+    int thread_id; // ... also the index of this worker's own deque
+    int num_threads;
+    ChunkDeque *deques; // ... every worker's deque, so we can steal
+    const uint8_t *buffer; // ... whole file
+    size_t file_size;
+    size_t chunk_size; // ... a whole number of leaves
+    uint64_t *leaf_hashes; // ... result slot per leaf, combined in order later
+    size_t chunks_hashed; // ... for debugging if needed
+    size_t chunks_stolen;
+} StealWorker;
+
+// one unit of work for the thread pool
+typedef struct Task {
+    void (*func)(void *arg);
+    void *arg;
+    struct Task *next;
+} Task;
+
+// long-lived worker threads that run submitted tasks in FIFO order, so the
+// cost of pthread_create/pthread_join is paid once instead of per file
+typedef struct {
+    pthread_t *threads;
+    int num_threads;
+    Task *head; // ... next task to run
+    Task *tail; // ... where new tasks are appended
+    int shutting_down; // ... set by destroy_thread_pool
+    pthread_mutex_t mutex; // ... protects the task list and shutting_down
+    pthread_cond_t not_empty; // ... signals when a task is available
+} ThreadPool;
+
+struct HashJob;
+
+// one chunk of a submitted file - worker_thread does the hashing
+typedef struct {
+    ThreadData data;
+    struct HashJob *job;
+} PoolChunk;
+
+// a file submitted to the pool - wait_file() blocks until it is done
+typedef struct HashJob {
+    ThreadPool *pool;
+    char *filename;
+    FileBuffer fb;
+    PoolChunk *chunks;
+    int num_chunks;
+    uint64_t *leaf_hashes; // ... filled in by the chunks, combined by wait_file
+    int remaining; // ... chunks not yet hashed
+    int finished; // ... 1 once every chunk is hashed (or loading failed)
+    int failed;
+    pthread_mutex_t mutex; // ... protects remaining, finished and failed
+    pthread_cond_t done; // ... signals when finished is set
+    void (*on_done)(struct HashJob *job); // ... if set, called instead of wait_file
+    void *owner; // ... for on_done
+} HashJob;
+
+// one line of the manifest
+typedef struct {
+    char *path;
+    uint64_t size;
+    uint64_t digest;
+} ManifestEntry;
+
+// shared state for hashing a whole directory tree on the thread pool
+typedef struct {
+    ThreadPool *pool;
+    ManifestEntry *entries;
+    size_t count;
+    size_t capacity;
+    size_t errors;
+    int outstanding; // ... tasks and split files not finished yet
+    pthread_mutex_t mutex; // ... protects everything above except pool
+    pthread_cond_t done; // ... signals when outstanding reaches 0
+} DirWalk;
+
+// header of a sidecar index - followed by num_leaves leaf digests
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t hash_mode; // ... digests from the other mode are useless
+    uint32_t leaf_size;
+    uint64_t file_size;
+    uint64_t inode;
+    uint64_t device;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    int64_t ctime_sec; // ... ctime can't be set by users, so a restored
+    int64_t ctime_nsec; // ... mtime still shows up as a change
+    uint64_t num_leaves;
+} IndexHeader;
+
+// a byte range the caller says was written since the last run
+typedef struct {
+    uint64_t offset;
+    uint64_t length;
+} DirtyRange;
+
+// what each re-hash worker needs to know
+typedef struct {
+    int fd;
+    const size_t *leaves; // ... leaf numbers to re-read and re-hash
+    size_t count;
+    uint64_t file_size;
+    uint64_t *leaf_hashes; // ... the new digests go straight into the full row
+    int failed;
+} RehashWorker;
+
+// shared by every verify worker
+typedef struct {
+    int fd;
+    uint64_t file_size;
+    const uint64_t *expected; // ... leaf digests from the index
+    size_t num_leaves;
+    size_t next_leaf; // ... first leaf of the next batch to hand out (atomic)
+    int cancelled; // ... set on a read error - everyone stops (atomic)
+    int read_error;
+    size_t bad_leaf; // ... lowest mismatching leaf seen, num_leaves if none (atomic reads)
+    pthread_mutex_t mutex; // ... protects read_error and updates to bad_leaf
+} VerifyJob;
+
+// one worker of the multi-digest mode - its slice of the file and its digests
+typedef struct {
+    const uint8_t *data;
+    size_t size;
+    int thread_id;
+    MultiDigest result;
+} DigestWorker;
+
+// one thread's share of a window in the boundary scan
+typedef struct {
+    const uint8_t *data; // ... the file from byte `base` on
+    uint64_t base;
+    uint64_t start; // ... scan positions [start, end)
+    uint64_t end;
+    uint64_t mask; // ... a cut candidate is where (hash & mask) == 0
+    uint64_t *candidates; // ... cut positions (just after the byte), in order
+    size_t count;
+    size_t capacity;
+    int failed;
+} CdcScanWorker;
+
+// one thread's share of the chunks cut from a window
+typedef struct {
+    const uint8_t *data; // ... the file from byte `base` on
+    uint64_t base;
+    const uint64_t *cuts; // ... chunk i is [cuts[i], cuts[i + 1])
+    size_t first; // ... chunks [first, last)
+    size_t last;
+    uint64_t *digests;
+} CdcHashWorker;
+
+// one distinct chunk seen in the run
+typedef struct {
+    uint64_t digest;
+    uint64_t size; // ... 0 = empty slot (chunks are never empty)
+    uint64_t refs; // ... how many times it was seen
+} DedupEntry;
+
+// open-addressing table of every distinct chunk across all files
+typedef struct {
+    DedupEntry *entries;
+    size_t capacity; // ... a power of two
+    size_t count;
+    uint64_t total_bytes;
+    uint64_t total_chunks;
+    uint64_t unique_bytes;
+} DedupIndex;
+
+// what --bench should run
+typedef struct {
+    const char *dir; // ... where the test files are generated
+    int sparse; // ... 1 = all-hole files, so 8-64 GiB tests need no disk space
+    size_t sizes[BENCH_MAX_SIZES];
+    int num_sizes;
+    int max_threads; // ... sweeps 1..max_threads
+    int repeats; // ... best of this many runs per point
+    int use_stream; // ... time hash_file_streaming instead of hash_file_multi_threaded
+    const char *csv_path; // ... NULL = no CSV
+    const char *json_path; // ... NULL = no JSON
+} BenchOptions;
+
+// one point of the sweep
+typedef struct {
+    size_t size;
+    int threads;
+    int cold; // ... 1 = page cache dropped before each run
+    CacheMode cache_mode; // ... how the hasher read the file
+    double seconds; // ... best wall-clock time
+    double gbps;
+    double speedup; // ... against 1 thread, same size and cache state
+    double efficiency; // ... speedup / threads
+    int digest_ok; // ... same digest as the 1 thread run
+    int failed; // ... the hasher returned no digest - no time or speedup either
+    double resident; // ... fraction of the file in the page cache after the run
+} BenchResult;
+
+// a directory waiting to be listed
+typedef struct {
+    DirWalk *walk;
+    char *path;
+} DirTask;
+
+// small files hashed back to back by one worker
+typedef struct {
+    DirWalk *walk;
+    int count;
+    size_t bytes;
+    char *paths[BATCH_MAX_FILES];
+} FileBatch;
+
+// wall-clock time in seconds - unlike clock() this doesn't add up the CPU
+// time of every thread
+double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// ========== profiling ==========
+// --profile / --trace=F: each stage records a span (name, thread, start, end)
+// and the workers add up bytes, busy time and idle time. when it's off every
+// hook is a single branch
+
+int start_profiler(void) {
+    profiler.events = malloc(PROFILE_MAX_EVENTS * sizeof(ProfileEvent));
+    if (profiler.events == NULL) {
+        printf("Error: out of memory\n");
+        return -1;
     }
 
-    return hash;
+    profiler.count = 0;
+    profiler.dropped = 0;
+    memset(profiler.threads, 0, sizeof(profiler.threads));
+    profiler.origin = now_seconds();
+    profiler.enabled = 1;
+
+    return 0;
 }
 
-void* worker_thread(void *arg) {
-    ThreadData *data = (ThreadData *)arg;
+// records the stage `name` as running on this thread from start to end
+// (both from now_seconds)
+void profile_span(const char *name, double start, double end) {
+    if (!profiler.enabled) {
+        return;
+    }
 
-    printf("Thread %d is completing hash\n", data->thread_id);
+    pthread_mutex_lock(&profiler.mutex);
+    if (profiler.count < PROFILE_MAX_EVENTS) {
+        ProfileEvent *e = &profiler.events[profiler.count++];
+        e->name = name;
+        e->tid = profile_tid;
+        e->start = start - profiler.origin;
+        e->end = end - profiler.origin;
+    } else {
+        profiler.dropped++;
+    }
+    pthread_mutex_unlock(&profiler.mutex);
+}
 
-    uint64_t hash = hash_chunk(data->data, data->size);
+// a hashing span - also counts towards this thread's bytes and busy time
+void profile_hash(size_t bytes, double start, double end) {
+    if (!profiler.enabled) {
+        return;
+    }
 
-    data->hash = hash;
+    profile_span("hash", start, end);
 
-    return NULL;
+    pthread_mutex_lock(&profiler.mutex);
+    profiler.threads[profile_tid].bytes += bytes;
+    profiler.threads[profile_tid].busy += end - start;
+    pthread_mutex_unlock(&profiler.mutex);
 }
 
-uint64_t hash_file_single_threaded(const char *filename) {
-    FILE *fp = fopen(filename, "rb");
-    if (fp == NULL) {
-        printf("Error: Cannot open file\n");
-        return 0;
+// after the join: workers 1..num_threads were all available for `seconds`
+void profile_phase(int num_threads, double seconds) {
+    if (!profiler.enabled) {
+        return;
     }
 
-    // find file size to allocate the correct memory
-    fseek(fp, 0, SEEK_END); // go to end of file
-    long file_size = ftell(fp); // get the position
-    fseek(fp, 0, SEEK_SET); // reset position to the start
+    pthread_mutex_lock(&profiler.mutex);
+    for (int i = 1; i <= num_threads && i < PROFILE_MAX_THREADS; i++) {
+        profiler.threads[i].span += seconds;
+    }
+    pthread_mutex_unlock(&profiler.mutex);
+}
 
-    printf("The file size is: %ld bytes\n", file_size);
+// worker n reports into slot n + 1, slot 0 is the thread that started it
+void profile_set_worker(int thread_id) {
+    profile_tid = thread_id + 1 < PROFILE_MAX_THREADS ? thread_id + 1 : PROFILE_MAX_THREADS - 1;
+}
 
-    // allocate the required amount of memory
-    uint8_t *buffer =  malloc(file_size);
-    if (buffer == NULL) {
-        printf("Error: out of memory\n");
-        fclose(fp);
-        return 0;
+void profile_thread_name(int tid, char *label, size_t size) {
+    if (tid == 0) {
+        snprintf(label, size, "main");
+    } else {
+        snprintf(label, size, "worker %d", tid - 1);
     }
+}
 
-    // now read the file into the buffer
-    size_t bytes_read = fread(buffer, 1, file_size, fp);
-    if (bytes_read != file_size) {
-        printf("Error: Could not read entire file\n");
-        free(buffer);
-        fclose(fp);
-        return 0;
+void print_profile(void) {
+    printf("\n%-14s %8s %12s\n", "stage", "count", "total ms");
+
+    // one row per stage name, in order of first appearance
+    for (size_t i = 0; i < profiler.count; i++) {
+        int seen = 0;
+        for (size_t j = 0; j < i && !seen; j++) {
+            seen = strcmp(profiler.events[j].name, profiler.events[i].name) == 0;
+        }
+        if (seen) {
+            continue;
+        }
+
+        size_t count = 0;
+        double total = 0;
+        for (size_t j = i; j < profiler.count; j++) {
+            if (strcmp(profiler.events[j].name, profiler.events[i].name) == 0) {
+                count++;
+                total += profiler.events[j].end - profiler.events[j].start;
+            }
+        }
+        printf("%-14s %8zu %12.3f\n", profiler.events[i].name, count, total * 1000);
     }
 
-    // now compute the hash
-    uint64_t hash = 0;
-    for (size_t i = 0; i < file_size; i++) {
-        hash += buffer[i];
+    if (profiler.dropped > 0) {
+        printf("(%zu more spans didn't fit in the trace buffer)\n", profiler.dropped);
     }
 
-    free(buffer);
+    printf("\n%-8s %14s %10s %10s %7s %8s\n", "thread", "bytes", "busy ms", "idle ms", "busy", "GB/s");
+    for (int i = 0; i < PROFILE_MAX_THREADS; i++) {
+        ThreadProfile *t = &profiler.threads[i];
+        if (t->bytes == 0 && t->span == 0) {
+            continue;
+        }
+
+        char label[32];
+        profile_thread_name(i, label, sizeof(label));
+
+        double idle = t->span > t->busy ? t->span - t->busy : 0;
+        printf("%-8s %14llu %10.3f %10.3f %6.0f%% %8.2f\n", label,
+               (unsigned long long)t->bytes, t->busy * 1000, idle * 1000,
+               t->span > 0 ? t->busy / t->span * 100 : 100,
+               t->busy > 0 ? t->bytes / t->busy / 1e9 : 0);
+    }
+}
+
+// Chrome trace-event JSON - open it in chrome://tracing or ui.perfetto.dev
+int write_trace(const char *path) {
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL) {
+        printf("Error: Cannot write '%s'\n", path);
+        return -1;
+    }
+
+    fprintf(fp, "{\"traceEvents\": [\n");
+
+    // name every thread that shows up
+    int named[PROFILE_MAX_THREADS] = { 0 };
+    for (size_t i = 0; i < profiler.count; i++) {
+        int tid = profiler.events[i].tid;
+        if (!named[tid]) {
+            named[tid] = 1;
+            char label[32];
+            profile_thread_name(tid, label, sizeof(label));
+            fprintf(fp, "  {\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, "
+                    "\"tid\": %d, \"args\": {\"name\": \"%s\"}},\n", tid, label);
+        }
+    }
+
+    for (size_t i = 0; i < profiler.count; i++) {
+        ProfileEvent *e = &profiler.events[i];
+        fprintf(fp, "  {\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, "
+                "\"ts\": %.3f, \"dur\": %.3f}%s\n", e->name, e->tid, e->start * 1e6,
+                (e->end - e->start) * 1e6, i + 1 < profiler.count ? "," : "");
+    }
+
+    fprintf(fp, "]}\n");
     fclose(fp);
 
-    return hash;
+    return 0;
 }
 
-uint64_t hash_file_multi_threaded(const char *filename, int num_threads) {
-    // first, determine the file size
+// ========== buffers ==========
+// every big buffer goes through here, so --huge-pages covers all of them.
+// huge pages cut TLB misses when hashing walks gigabytes of memory
+
+// what alloc_buffer really maps for `size` bytes - free_buffer needs the same
+size_t buffer_length(size_t size) {
+    if (size == 0) {
+        size = 1; // ... so an empty file still gets a valid pointer
+    }
+    if (config.page_mode == PAGES_HUGETLB) {
+        size = (size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+    }
+    return size;
+}
+
+int hugetlb_warned = 0;
+
+// page-aligned in every mode except PAGES_NORMAL - returns NULL if out of memory
+uint8_t* alloc_buffer(size_t size) {
+    if (config.page_mode == PAGES_NORMAL) {
+        return malloc(size > 0 ? size : 1);
+    }
+
+    size_t length = buffer_length(size);
+    void *map = MAP_FAILED;
+
+    if (config.page_mode == PAGES_HUGETLB) {
+        map = mmap(NULL, length, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (map == MAP_FAILED &&
+            __atomic_exchange_n(&hugetlb_warned, 1, __ATOMIC_RELAXED) == 0) {
+            printf("Note: no reserved huge pages (vm.nr_hugepages), using transparent ones\n");
+        }
+    }
+
+    if (map == MAP_FAILED) {
+        map = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (map == MAP_FAILED) {
+            return NULL;
+        }
+        // only a hint - without THP enabled this does nothing
+        madvise(map, length, MADV_HUGEPAGE);
+    }
+
+    return map;
+}
+
+void free_buffer(uint8_t *buffer, size_t size) {
+    if (buffer == NULL) {
+        return;
+    }
+
+    if (config.page_mode == PAGES_NORMAL) {
+        free(buffer);
+    } else {
+        munmap(buffer, buffer_length(size));
+    }
+}
+
+int read_file(const char *filename, FileBuffer *fb) {
+    double start = now_seconds();
+
     FILE *fp = fopen(filename, "rb");
     if (fp == NULL) {
         printf("Error: Cannot open file\n");
-        return 0;
+        return -1;
+    }
+
+    // find file size to allocate the correct memory - fstat rather than
+    // ftell, whose long is 32 bits on some platforms
+    struct stat st;
+    if (fstat(fileno(fp), &st) != 0) {
+        printf("Error: Cannot stat file\n");
+        fclose(fp);
+        return -1;
     }
+    size_t file_size = st.st_size;
 
-    fseek(fp, 0, SEEK_END); 
-    long file_size = ftell(fp);
-    fseek(fp, 0, SEEK_SET); 
+    profile_span("open/size", start, now_seconds());
+    start = now_seconds();
 
     // allocate the required amount of memory
-    uint8_t *buffer =  malloc(file_size);
+    uint8_t *buffer = alloc_buffer(file_size);
     if (buffer == NULL) {
         printf("Error: out of memory\n");
         fclose(fp);
-        return 0;
+        return -1;
     }
 
     // now read the file into the buffer
     size_t bytes_read = fread(buffer, 1, file_size, fp);
     if (bytes_read != file_size) {
         printf("Error: Could not read entire file\n");
-        free(buffer);
+        free_buffer(buffer, file_size);
         fclose(fp);
-        return 0;
+        return -1;
     }
 
-    // next, determine the start position for each thread
-    size_t i = 0;
-    int chunk_size = (file_size + num_threads - 1) / num_threads;
+    fclose(fp);
 
-    // set up thread data array
-    ThreadData thread_data[num_threads];
-    pthread_t threads[num_threads];
+    profile_span("read", start, now_seconds());
 
-    while (i < num_threads) {
-        int final_chunk_size = chunk_size;
+    fb->data = buffer;
+    fb->size = file_size;
+    fb->is_mapped = 0;
 
-        // get the start position in the buffer for this chunk
-        int start_pos = chunk_size * i;
-        // then calc the end position of this chunk based off default chunk size
-        int end_pos = start_pos + chunk_size; 
+    return 0;
+}
 
-        if (end_pos > file_size) {
-            final_chunk_size = file_size - start_pos;
+int map_file(const char *filename, FileBuffer *fb) {
+    double start = now_seconds();
+
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        printf("Error: Cannot open file\n");
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        printf("Error: Cannot stat file\n");
+        close(fd);
+        return -1;
+    }
+
+    fb->data = NULL;
+    fb->size = st.st_size;
+    fb->is_mapped = 1;
+
+    // mmap refuses a zero length mapping, an empty file just hashes to 0
+    if (fb->size > 0) {
+        void *map = mmap(NULL, fb->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            printf("Error: Cannot map file\n");
+            close(fd);
+            return -1;
         }
 
-        thread_data[i].data = buffer + chunk_size * i;
-        thread_data[i].thread_id = i;
-        thread_data[i].size = final_chunk_size;
+        // tell the kernel to read ahead aggressively and start now, so pages
+        // are already arriving while the threads are being created
+        madvise(map, fb->size, MADV_SEQUENTIAL);
+        madvise(map, fb->size, MADV_WILLNEED);
 
-        i++;
+        fb->data = map;
     }
 
-    // create threads
-    for (int i = 0; i < num_threads; i++) {
-        pthread_create(&threads[i], NULL, worker_thread, &thread_data[i]);
+    // the mapping keeps its own reference to the file
+    close(fd);
+
+    profile_span("map", start, now_seconds());
+
+    return 0;
+}
+
+// ========== io_uring ==========
+// talks to the kernel with the raw syscalls, so liburing isn't needed.
+// two shared rings: we put read requests on the submission queue, the kernel
+// puts results on the completion queue
+
+#ifdef HAVE_IO_URING
+typedef struct {
+    int ring_fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ptr;
+    void *cq_ptr;
+    size_t sq_len;
+    size_t cq_len;
+    size_t sqes_len;
+    unsigned pending; // ... requests queued but not yet passed to the kernel
+} URing;
+
+// returns -1 if io_uring can't be used (old kernel, seccomp, ...)
+int uring_init(URing *r, unsigned entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    memset(r, 0, sizeof(*r));
+
+    r->ring_fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (r->ring_fd < 0) {
+        return -1;
     }
 
-    for (int i = 0; i < num_threads; i++) {
-        pthread_join(threads[i], NULL);
+    r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+    // newer kernels let both rings share one mapping
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_len > r->sq_len) {
+            r->sq_len = r->cq_len;
+        }
+        r->cq_len = r->sq_len;
     }
 
-    uint64_t final_hash = 0;
-    for (int i = 0; i < num_threads; i++) {
-        final_hash += thread_data[i].hash;
+    r->sq_ptr = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     r->ring_fd, IORING_OFF_SQ_RING);
+    if (r->sq_ptr == MAP_FAILED) {
+        close(r->ring_fd);
+        return -1;
     }
 
-    return final_hash;
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_ptr = r->sq_ptr;
+    } else {
+        r->cq_ptr = mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         r->ring_fd, IORING_OFF_CQ_RING);
+        if (r->cq_ptr == MAP_FAILED) {
+            munmap(r->sq_ptr, r->sq_len);
+            close(r->ring_fd);
+            return -1;
+        }
+    }
+
+    r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   r->ring_fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        if (r->cq_ptr != r->sq_ptr) {
+            munmap(r->cq_ptr, r->cq_len);
+        }
+        munmap(r->sq_ptr, r->sq_len);
+        close(r->ring_fd);
+        return -1;
+    }
+
+    uint8_t *sq = r->sq_ptr;
+    uint8_t *cq = r->cq_ptr;
+    r->sq_head = (unsigned *)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(sq + p.sq_off.array);
+    r->cq_head = (unsigned *)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    return 0;
 }
 
-int main() {
-    clock_t start = clock();
-    
-    uint64_t hash = hash_file_single_threaded("test_file.bin");
-    
-    clock_t end = clock();
-    double time_spent = (double)(end - start) / CLOCKS_PER_SEC;
-    
-    printf("Hash: %llu\n", hash);
-    printf("Time: %.3f seconds\n", time_spent);
+void uring_exit(URing *r) {
+    munmap(r->sqes, r->sqes_len);
+    if (r->cq_ptr != r->sq_ptr) {
+        munmap(r->cq_ptr, r->cq_len);
+    }
+    munmap(r->sq_ptr, r->sq_len);
+    close(r->ring_fd);
+}
 
-    clock_t start_parallel = clock();
+// pins the buffers so READ_FIXED can skip mapping them on every request
+int uring_register_buffers(URing *r, const struct iovec *iov, unsigned count) {
+    return syscall(__NR_io_uring_register, r->ring_fd, IORING_REGISTER_BUFFERS, iov, count);
+}
 
-    uint64_t hash_parallel = hash_file_multi_threaded("test_file.bin", 3);
+// queues one read - buf_index < 0 means the buffer isn't registered
+void uring_queue_read(URing *r, int fd, void *buf, unsigned length, uint64_t offset,
+                      int buf_index, uint64_t user_data) {
+    unsigned tail = *r->sq_tail;
+    unsigned index = tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[index];
 
-    clock_t end_parallel = clock();
-    double time_spent_parallel = (double)(end_parallel - start_parallel) / CLOCKS_PER_SEC;
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = buf_index >= 0 ? IORING_OP_READ_FIXED : IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = length;
+    sqe->off = offset;
+    sqe->buf_index = buf_index >= 0 ? buf_index : 0;
+    sqe->user_data = user_data;
 
-    printf("Hash: %llu\n", hash_parallel);
-    printf("Time: %.3f seconds\n", time_spent_parallel);
-    
-    return 0;
+    r->sq_array[index] = index;
+
+    // the kernel must see the filled-in entry before the new tail
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    r->pending++;
+}
+
+// submits everything queued and waits for at least one completion
+int uring_submit_and_wait(URing *r) {
+    while (1) {
+        int n = syscall(__NR_io_uring_enter, r->ring_fd, r->pending, 1,
+                        IORING_ENTER_GETEVENTS, NULL, 0);
+        if (n >= 0) {
+            r->pending -= n;
+            return 0;
+        }
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+}
+
+// takes the next completion if there is one - returns 1 if it did
+int uring_next_completion(URing *r, uint64_t *user_data, int *result) {
+    unsigned head = *r->cq_head;
+
+    if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+
+    struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+    *user_data = cqe->user_data;
+    *result = cqe->res;
+
+    __atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+    return 1;
 }
 
+// a read in flight while loading a whole file
+typedef struct {
+    uint64_t offset; // ... where the rest of this piece starts
+    size_t remaining; // ... bytes of this piece still to read
+} UringPiece;
+
+// like read_file, but with URING_QUEUE_DEPTH reads in flight - returns 1 if
+// io_uring isn't available so the caller can fall back
+int read_file_uring(const char *filename, FileBuffer *fb) {
+    double start = now_seconds();
+
+    URing ring;
+    if (uring_init(&ring, URING_QUEUE_DEPTH) != 0) {
+        return 1;
+    }
+
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        printf("Error: Cannot open file\n");
+        uring_exit(&ring);
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        printf("Error: Cannot stat file\n");
+        close(fd);
+        uring_exit(&ring);
+        return -1;
+    }
+
+    size_t file_size = st.st_size;
+    uint8_t *buffer = alloc_buffer(file_size);
+    if (buffer == NULL) {
+        printf("Error: out of memory\n");
+        close(fd);
+        uring_exit(&ring);
+        return -1;
+    }
+
+    UringPiece pieces[URING_QUEUE_DEPTH];
+    uint64_t next = 0; // ... offset of the next piece to hand out
+    int in_flight = 0;
+    int failed = 0;
+
+    // prime the ring, one slot per piece
+    for (int slot = 0; slot < URING_QUEUE_DEPTH && next < file_size; slot++) {
+        size_t length = file_size - next < URING_READ_SIZE ? file_size - next : URING_READ_SIZE;
+        pieces[slot].offset = next;
+        pieces[slot].remaining = length;
+        uring_queue_read(&ring, fd, buffer + next, length, next, -1, slot);
+        next += length;
+        in_flight++;
+    }
+
+    while (in_flight > 0 && !failed) {
+        if (uring_submit_and_wait(&ring) != 0) {
+            failed = 1;
+            break;
+        }
+
+        uint64_t slot;
+        int result;
+        while (uring_next_completion(&ring, &slot, &result)) {
+            UringPiece *piece = &pieces[slot];
+
+            if (result == -EINTR || result == -EAGAIN) {
+                result = 0; // ... just ask again
+            } else if (result < 0 || (result == 0 && piece->remaining > 0)) {
+                failed = 1; // ... error, or the file shrank
+            }
+            if (failed) {
+                in_flight--; // ... nothing more gets queued once one read fails
+                continue;
+            }
+
+            piece->offset += result;
+            piece->remaining -= result;
+
+            // short read - ask for the rest of the piece, else start a new one
+            if (piece->remaining == 0 && next < file_size) {
+                size_t length = file_size - next < URING_READ_SIZE ? file_size - next : URING_READ_SIZE;
+                piece->offset = next;
+                piece->remaining = length;
+                next += length;
+            }
+
+            if (piece->remaining > 0) {
+                uring_queue_read(&ring, fd, buffer + piece->offset, piece->remaining,
+                                 piece->offset, -1, slot);
+            } else {
+                in_flight--;
+            }
+        }
+    }
+
+    // on failure, wait out the reads still in flight before the buffer is freed
+    while (in_flight > 0 && uring_submit_and_wait(&ring) == 0) {
+        uint64_t slot;
+        int result;
+        while (uring_next_completion(&ring, &slot, &result)) {
+            in_flight--;
+        }
+    }
+
+    close(fd);
+    uring_exit(&ring);
+
+    if (failed) {
+        printf("Error: Could not read entire file\n");
+        free_buffer(buffer, file_size);
+        return -1;
+    }
+
+    fb->data = buffer;
+    fb->size = file_size;
+    fb->is_mapped = 0;
+
+    profile_span("read", start, now_seconds());
+
+    return 0;
+}
+#endif
+
+int uring_warned = 0;
+
+// prints the fallback message once, however many files are loaded
+void uring_unavailable(void) {
+    if (__atomic_exchange_n(&uring_warned, 1, __ATOMIC_RELAXED) == 0) {
+        printf("Note: io_uring can't be used here, falling back to read()\n");
+    }
+}
+
+// asks the kernel to forget the file's pages, so the next read hits the disk.
+// works without root, but only for pages that are already written back
+void drop_file_cache(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+}
+
+int direct_warned = 0;
+
+// opens a file for the streaming readers. with --direct it asks for O_DIRECT
+// and sets *direct, so the reader keeps its reads aligned - filesystems that
+// refuse O_DIRECT (tmpfs, some FUSE) get a normal fd and DONTNEED instead
+int open_input(const char *filename, int *direct) {
+    *direct = 0;
+
+    if (config.cache_mode == CACHE_DIRECT) {
+        int fd = open(filename, O_RDONLY | O_DIRECT);
+        if (fd >= 0) {
+            *direct = 1;
+            return fd;
+        }
+        if (errno != EINVAL) {
+            return -1;
+        }
+        if (__atomic_exchange_n(&direct_warned, 1, __ATOMIC_RELAXED) == 0) {
+            printf("Note: O_DIRECT can't be used here, dropping the cache after each read\n");
+        }
+    }
+
+    return open(filename, O_RDONLY);
+}
+
+// --drop-cache / --direct fallback: evict a range the reader has finished with
+void drop_range(int fd, int direct, uint64_t offset, uint64_t length) {
+    if (config.cache_mode != CACHE_KEEP && !direct) {
+        posix_fadvise(fd, offset, length, POSIX_FADV_DONTNEED);
+    }
+}
+
+// pread until `length` bytes or end of file - returns bytes read, -1 on error
+ssize_t pread_full(int fd, uint8_t *data, size_t length, uint64_t offset) {
+    size_t done = 0;
+
+    while (done < length) {
+        ssize_t n = pread(fd, data + done, length - done, offset + done);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        done += n;
+    }
+
+    return done;
+}
+
+int load_file(const char *filename, FileBuffer *fb) {
+    if (config.input_mode == INPUT_MMAP) {
+        return map_file(filename, fb);
+    }
+
+    int result = -1;
+    int loaded = 0;
+
+    if (config.io_backend == IO_URING) {
+#ifdef HAVE_IO_URING
+        result = read_file_uring(filename, fb);
+        loaded = (result != 1);
+#endif
+        if (!loaded) {
+            uring_unavailable();
+        }
+    }
+
+    if (!loaded) {
+        result = read_file(filename, fb);
+    }
+
+    // whole-file loads are one big read, so the best we can do is drop the
+    // pages straight after (only --stream reads with O_DIRECT)
+    if (result == 0 && config.cache_mode != CACHE_KEEP) {
+        drop_file_cache(filename);
+    }
+
+    return result;
+}
+
+void release_file(FileBuffer *fb) {
+    if (fb->data != NULL) {
+        if (fb->is_mapped) {
+            munmap(fb->data, fb->size);
+        } else {
+            free_buffer(fb->data, fb->size);
+        }
+    }
+
+    fb->data = NULL;
+    fb->size = 0;
+}
+
+// ========== hash_chunk kernels ==========
+// every kernel returns the same byte sum - the vector ones use psadbw
+// (sum of absolute differences against zero), which adds up 8 bytes into a
+// 64-bit lane in one instruction
+
+typedef uint64_t (*HashKernel)(const uint8_t *data, size_t size);
+
+uint64_t hash_chunk_scalar(const uint8_t *data, size_t size) {
+    uint64_t hash = 0;
+
+    for (size_t i = 0; i < size; i++) {
+        hash += data[i];
+    }
+
+    return hash;
+}
+
+#ifdef HAVE_X86_KERNELS
+__attribute__((target("sse2")))
+uint64_t hash_chunk_sse2(const uint8_t *data, size_t size) {
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc0 = _mm_setzero_si128();
+    __m128i acc1 = _mm_setzero_si128();
+    size_t i = 0;
+
+    // two accumulators so consecutive adds don't wait on each other
+    for (; i + 64 <= size; i += 64) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(data + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(data + i + 16));
+        __m128i c = _mm_loadu_si128((const __m128i *)(data + i + 32));
+        __m128i d = _mm_loadu_si128((const __m128i *)(data + i + 48));
+        acc0 = _mm_add_epi64(acc0, _mm_sad_epu8(a, zero));
+        acc1 = _mm_add_epi64(acc1, _mm_sad_epu8(b, zero));
+        acc0 = _mm_add_epi64(acc0, _mm_sad_epu8(c, zero));
+        acc1 = _mm_add_epi64(acc1, _mm_sad_epu8(d, zero));
+    }
+
+    for (; i + 16 <= size; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(data + i));
+        acc0 = _mm_add_epi64(acc0, _mm_sad_epu8(a, zero));
+    }
+
+    uint64_t lanes[2];
+    _mm_storeu_si128((__m128i *)lanes, _mm_add_epi64(acc0, acc1));
+
+    return lanes[0] + lanes[1] + hash_chunk_scalar(data + i, size - i);
+}
+
+__attribute__((target("avx2")))
+uint64_t hash_chunk_avx2(const uint8_t *data, size_t size) {
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i acc0 = _mm256_setzero_si256();
+    __m256i acc1 = _mm256_setzero_si256();
+    size_t i = 0;
+
+    for (; i + 128 <= size; i += 128) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(data + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(data + i + 32));
+        __m256i c = _mm256_loadu_si256((const __m256i *)(data + i + 64));
+        __m256i d = _mm256_loadu_si256((const __m256i *)(data + i + 96));
+        acc0 = _mm256_add_epi64(acc0, _mm256_sad_epu8(a, zero));
+        acc1 = _mm256_add_epi64(acc1, _mm256_sad_epu8(b, zero));
+        acc0 = _mm256_add_epi64(acc0, _mm256_sad_epu8(c, zero));
+        acc1 = _mm256_add_epi64(acc1, _mm256_sad_epu8(d, zero));
+    }
+
+    for (; i + 32 <= size; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(data + i));
+        acc0 = _mm256_add_epi64(acc0, _mm256_sad_epu8(a, zero));
+    }
+
+    uint64_t lanes[4];
+    _mm256_storeu_si256((__m256i *)lanes, _mm256_add_epi64(acc0, acc1));
+
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] + hash_chunk_scalar(data + i, size - i);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+uint64_t hash_chunk_avx512(const uint8_t *data, size_t size) {
+    const __m512i zero = _mm512_setzero_si512();
+    __m512i acc0 = _mm512_setzero_si512();
+    __m512i acc1 = _mm512_setzero_si512();
+    size_t i = 0;
+
+    for (; i + 256 <= size; i += 256) {
+        __m512i a = _mm512_loadu_si512((const void *)(data + i));
+        __m512i b = _mm512_loadu_si512((const void *)(data + i + 64));
+        __m512i c = _mm512_loadu_si512((const void *)(data + i + 128));
+        __m512i d = _mm512_loadu_si512((const void *)(data + i + 192));
+        acc0 = _mm512_add_epi64(acc0, _mm512_sad_epu8(a, zero));
+        acc1 = _mm512_add_epi64(acc1, _mm512_sad_epu8(b, zero));
+        acc0 = _mm512_add_epi64(acc0, _mm512_sad_epu8(c, zero));
+        acc1 = _mm512_add_epi64(acc1, _mm512_sad_epu8(d, zero));
+    }
+
+    for (; i + 64 <= size; i += 64) {
+        __m512i a = _mm512_loadu_si512((const void *)(data + i));
+        acc0 = _mm512_add_epi64(acc0, _mm512_sad_epu8(a, zero));
+    }
+
+    uint64_t hash = _mm512_reduce_add_epi64(_mm512_add_epi64(acc0, acc1));
+
+    return hash + hash_chunk_scalar(data + i, size - i);
+}
+#endif
+
+// picked once by select_hash_kernel() - main can force one with --kernel=
+HashKernel hash_kernel = hash_chunk_scalar;
+const char *hash_kernel_name = "scalar";
+pthread_once_t hash_kernel_once = PTHREAD_ONCE_INIT;
+
+// returns 0 if the kernel exists and this CPU can run it
+int set_hash_kernel(const char *name) {
+    if (strcmp(name, "scalar") == 0) {
+        hash_kernel = hash_chunk_scalar;
+#ifdef HAVE_X86_KERNELS
+    } else if (strcmp(name, "sse2") == 0 && __builtin_cpu_supports("sse2")) {
+        hash_kernel = hash_chunk_sse2;
+    } else if (strcmp(name, "avx2") == 0 && __builtin_cpu_supports("avx2")) {
+        hash_kernel = hash_chunk_avx2;
+    } else if (strcmp(name, "avx512") == 0 && __builtin_cpu_supports("avx512bw")) {
+        hash_kernel = hash_chunk_avx512;
+#endif
+    } else {
+        return -1;
+    }
+
+    hash_kernel_name = name;
+    return 0;
+}
+
+// CPUID dispatch - the widest kernel this CPU supports
+void select_hash_kernel(void) {
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+
+    if (set_hash_kernel("avx512") == 0 || set_hash_kernel("avx2") == 0 ||
+        set_hash_kernel("sse2") == 0) {
+        return;
+    }
+#endif
+    set_hash_kernel("scalar");
+}
+
+uint64_t hash_chunk(uint8_t *data, size_t size) {
+    pthread_once(&hash_kernel_once, select_hash_kernel);
+
+    return hash_kernel(data, size);
+}
+
+// ========== tree digest ==========
+// xxHash64 (https://github.com/Cyan4973/xxHash) - fast, well tested and
+// order-sensitive, which the byte sum is not. assumes a little-endian host
+
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3 0x165667B19E3779F9ULL
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ULL
+
+uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+uint64_t read64(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+uint32_t read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+uint64_t xxh64_round(uint64_t acc, uint64_t input) {
+    acc += input * XXH_PRIME64_2;
+    acc = rotl64(acc, 31);
+    return acc * XXH_PRIME64_1;
+}
+
+uint64_t xxh64_merge_round(uint64_t acc, uint64_t val) {
+    acc ^= xxh64_round(0, val);
+    return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+uint64_t xxh64(const uint8_t *data, size_t len, uint64_t seed) {
+    const uint8_t *p = data;
+    const uint8_t *end = data + len;
+    uint64_t h;
+
+    if (len >= 32) {
+        uint64_t v1 = seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+        uint64_t v2 = seed + XXH_PRIME64_2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - XXH_PRIME64_1;
+
+        // four independent lanes of 8 bytes each
+        do {
+            v1 = xxh64_round(v1, read64(p));
+            v2 = xxh64_round(v2, read64(p + 8));
+            v3 = xxh64_round(v3, read64(p + 16));
+            v4 = xxh64_round(v4, read64(p + 24));
+            p += 32;
+        } while (p + 32 <= end);
+
+        h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+        h = xxh64_merge_round(h, v1);
+        h = xxh64_merge_round(h, v2);
+        h = xxh64_merge_round(h, v3);
+        h = xxh64_merge_round(h, v4);
+    } else {
+        h = seed + XXH_PRIME64_5;
+    }
+
+    h += (uint64_t)len;
+
+    while (p + 8 <= end) {
+        h ^= xxh64_round(0, read64(p));
+        h = rotl64(h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+        p += 8;
+    }
+
+    if (p + 4 <= end) {
+        h ^= (uint64_t)read32(p) * XXH_PRIME64_1;
+        h = rotl64(h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+        p += 4;
+    }
+
+    while (p < end) {
+        h ^= (*p) * XXH_PRIME64_5;
+        h = rotl64(h, 11) * XXH_PRIME64_1;
+        p++;
+    }
+
+    // final avalanche
+    h ^= h >> 33;
+    h *= XXH_PRIME64_2;
+    h ^= h >> 29;
+    h *= XXH_PRIME64_3;
+    h ^= h >> 32;
+
+    return h;
+}
+
+// number of leaves in `size` bytes (the last one may be short)
+size_t leaf_count(size_t size) {
+    return (size + LEAF_SIZE - 1) / LEAF_SIZE;
+}
+
+// rounds a chunk size up to a whole number of leaves
+size_t round_to_leaves(size_t size) {
+    if (size < LEAF_SIZE) {
+        return LEAF_SIZE;
+    }
+    return leaf_count(size) * LEAF_SIZE;
+}
+
+uint64_t hash_leaf(const uint8_t *data, size_t size) {
+    if (config.hash_mode == HASH_TREE) {
+        return xxh64(data, size, LEAF_SEED);
+    }
+
+    return hash_chunk((uint8_t *)data, size);
+}
+
+// writes one digest per leaf - data must start on a leaf boundary
+void hash_leaves(const uint8_t *data, size_t size, uint64_t *leaf_hashes) {
+    for (size_t offset = 0; offset < size; offset += LEAF_SIZE) {
+        size_t leaf_size = size - offset;
+        if (leaf_size > LEAF_SIZE) {
+            leaf_size = LEAF_SIZE;
+        }
+
+        *leaf_hashes++ = hash_leaf(data + offset, leaf_size);
+    }
+}
+
+uint64_t hash_node(uint64_t left, uint64_t right, uint64_t seed) {
+    uint64_t pair[2] = { left, right };
+    return xxh64((const uint8_t *)pair, sizeof(pair), seed);
+}
+
+// turns the row of leaf digests into the file digest. sum mode just adds them
+// up. tree mode merges neighbours level by level (an odd one out moves up
+// unchanged) and mixes the file size into the root, so the shape of the tree
+// depends only on the file size
+uint64_t combine_leaves(const uint64_t *leaf_hashes, size_t num_leaves, uint64_t total_size) {
+    if (config.hash_mode == HASH_SUM) {
+        uint64_t total = 0;
+        for (size_t i = 0; i < num_leaves; i++) {
+            total += leaf_hashes[i];
+        }
+        return total;
+    }
+
+    uint64_t root;
+
+    if (num_leaves == 0) {
+        root = hash_leaf(NULL, 0); // ... an empty file is one empty leaf
+    } else if (num_leaves == 1) {
+        root = leaf_hashes[0];
+    } else {
+        size_t count = (num_leaves + 1) / 2;
+        uint64_t *level = malloc(count * sizeof(uint64_t));
+        if (level == NULL) {
+            printf("Error: out of memory\n");
+            return 0;
+        }
+
+        // first level straight from the leaves, the rest in place
+        for (size_t i = 0; i < count; i++) {
+            if (2 * i + 1 < num_leaves) {
+                level[i] = hash_node(leaf_hashes[2 * i], leaf_hashes[2 * i + 1], NODE_SEED);
+            } else {
+                level[i] = leaf_hashes[2 * i];
+            }
+        }
+
+        while (count > 1) {
+            size_t next = (count + 1) / 2;
+            for (size_t i = 0; i < next; i++) {
+                if (2 * i + 1 < count) {
+                    level[i] = hash_node(level[2 * i], level[2 * i + 1], NODE_SEED);
+                } else {
+                    level[i] = level[2 * i];
+                }
+            }
+            count = next;
+        }
+
+        root = level[0];
+        free(level);
+    }
+
+    return hash_node(root, total_size, ROOT_SEED);
+}
+
+// --pin: worker n runs only on the n-th CPU in our affinity mask (wrapping
+// around), so the scheduler can't move it away from the memory it touched
+void pin_worker(int thread_id) {
+    if (!config.pin_threads) {
+        return;
+    }
+
+    // new threads inherit the main thread's mask, so this is the process's
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        return;
+    }
+
+    int target = thread_id % CPU_COUNT(&allowed);
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &allowed) && target-- == 0) {
+            cpu_set_t one;
+            CPU_ZERO(&one);
+            CPU_SET(cpu, &one);
+            pthread_setaffinity_np(pthread_self(), sizeof(one), &one);
+            return;
+        }
+    }
+}
+
+void* worker_thread(void *arg) {
+    ThreadData *data = (ThreadData *)arg;
+
+    if (config.verbose) {
+        printf("Thread %d is completing hash\n", data->thread_id);
+    }
+
+    hash_leaves(data->data, data->size, data->leaf_hashes);
+
+    return NULL;
+}
+
+// hash_file_multi_threaded's threads - optionally pinned, and with
+// --first-touch they read their own slice, so the kernel places its pages on
+// this worker's NUMA node rather than on the main thread's
+void* slice_worker_thread(void *arg) {
+    ThreadData *data = (ThreadData *)arg;
+
+    pin_worker(data->thread_id);
+    profile_set_worker(data->thread_id);
+
+    if (data->fd >= 0 && data->size > 0) {
+        double start = now_seconds();
+        if (pread_full(data->fd, data->data, data->size, data->offset) != (ssize_t)data->size) {
+            data->failed = 1;
+            return NULL;
+        }
+        drop_range(data->fd, 0, data->offset, data->size);
+        profile_span("read", start, now_seconds());
+    }
+
+    double start = now_seconds();
+    worker_thread(data);
+    profile_hash(data->size, start, now_seconds());
+
+    return NULL;
+}
+
+uint64_t hash_file_single_threaded(const char *filename) {
+    FileBuffer fb;
+    if (load_file(filename, &fb) != 0) {
+        return 0;
+    }
+
+    if (config.verbose) {
+        printf("The file size is: %zu bytes\n", fb.size);
+    }
+
+    uint64_t *leaf_hashes = malloc((leaf_count(fb.size) + 1) * sizeof(uint64_t));
+    if (leaf_hashes == NULL) {
+        printf("Error: out of memory\n");
+        release_file(&fb);
+        return 0;
+    }
+
+    // now compute the hash
+    hash_leaves(fb.data, fb.size, leaf_hashes);
+    uint64_t hash = combine_leaves(leaf_hashes, leaf_count(fb.size), fb.size);
+
+    free(leaf_hashes);
+    release_file(&fb);
+
+    return hash;
+}
+
+// returns 1 and sets *chunk_id if the deque had work, 0 if it was empty
+int take_chunk(ChunkDeque *dq, int from_tail, size_t *chunk_id) {
+    int found = 0;
+
+    pthread_mutex_lock(&dq->mutex);
+
+    if (dq->head < dq->tail) {
+        if (from_tail) {
+            dq->tail--;
+            *chunk_id = dq->chunks[dq->tail];
+        } else {
+            *chunk_id = dq->chunks[dq->head];
+            dq->head++;
+        }
+        found = 1;
+    }
+
+    pthread_mutex_unlock(&dq->mutex);
+
+    return found;
+}
+
+void* steal_worker_thread(void *arg) {
+    StealWorker *w = (StealWorker *)arg;
+
+    pin_worker(w->thread_id);
+    profile_set_worker(w->thread_id);
+
+    while (1) {
+        size_t chunk_id;
+
+        // own work first
+        int found = take_chunk(&w->deques[w->thread_id], 0, &chunk_id);
+
+        // then try everyone else, starting with our neighbour so thieves spread out.
+        // no new chunks are ever added, so once every deque is empty we're done
+        for (int i = 1; !found && i < w->num_threads; i++) {
+            int victim = (w->thread_id + i) % w->num_threads;
+            found = take_chunk(&w->deques[victim], 1, &chunk_id);
+            if (found) {
+                w->chunks_stolen++;
+            }
+        }
+
+        if (!found) {
+            break;
+        }
+
+        size_t start = chunk_id * w->chunk_size;
+        size_t size = w->chunk_size;
+        if (start + size > w->file_size) {
+            size = w->file_size - start;
+        }
+
+        double hash_start = now_seconds();
+        hash_leaves(w->buffer + start, size, w->leaf_hashes + start / LEAF_SIZE);
+        profile_hash(size, hash_start, now_seconds());
+        w->chunks_hashed++;
+    }
+
+    return NULL;
+}
+
+// splits the buffer into many small chunks instead of one slice per thread -
+// a slow thread just ends up with fewer chunks rather than holding up the join
+uint64_t hash_buffer_work_stealing(const uint8_t *buffer, size_t size, int num_threads) {
+    size_t chunk_size = round_to_leaves(config.chunk_size);
+    size_t num_chunks = (size + chunk_size - 1) / chunk_size;
+
+    uint64_t *leaf_hashes = calloc(leaf_count(size) + 1, sizeof(uint64_t));
+    size_t *chunk_ids = malloc((num_chunks + 1) * sizeof(size_t));
+    if (leaf_hashes == NULL || chunk_ids == NULL) {
+        printf("Error: out of memory\n");
+        free(leaf_hashes);
+        free(chunk_ids);
+        return 0;
+    }
+
+    ChunkDeque deques[num_threads];
+    StealWorker workers[num_threads];
+    pthread_t threads[num_threads];
+
+    // each worker starts with a contiguous run of chunks
+    for (int i = 0; i < num_threads; i++) {
+        size_t first = num_chunks * i / num_threads;
+        size_t last = num_chunks * (i + 1) / num_threads;
+
+        for (size_t c = first; c < last; c++) {
+            chunk_ids[c] = c;
+        }
+
+        deques[i].chunks = chunk_ids;
+        deques[i].head = first;
+        deques[i].tail = last;
+        pthread_mutex_init(&deques[i].mutex, NULL);
+
+        workers[i].thread_id = i;
+        workers[i].num_threads = num_threads;
+        workers[i].deques = deques;
+        workers[i].buffer = buffer;
+        workers[i].file_size = size;
+        workers[i].chunk_size = chunk_size;
+        workers[i].leaf_hashes = leaf_hashes;
+        workers[i].chunks_hashed = 0;
+        workers[i].chunks_stolen = 0;
+    }
+
+    double spawn_start = now_seconds();
+    for (int i = 0; i < num_threads; i++) {
+        pthread_create(&threads[i], NULL, steal_worker_thread, &workers[i]);
+    }
+    double join_start = now_seconds();
+    profile_span("spawn", spawn_start, join_start);
+
+    for (int i = 0; i < num_threads; i++) {
+        pthread_join(threads[i], NULL);
+        if (config.verbose) {
+            printf("Thread %d hashed %zu chunks (%zu stolen)\n",
+                   i, workers[i].chunks_hashed, workers[i].chunks_stolen);
+        }
+    }
+    double join_end = now_seconds();
+    profile_span("join", join_start, join_end);
+    profile_phase(num_threads, join_end - spawn_start);
+
+    // only once every thread is gone - a running thread may still try to steal
+    for (int i = 0; i < num_threads; i++) {
+        pthread_mutex_destroy(&deques[i].mutex);
+    }
+
+    // combine in leaf order, so the result never depends on who hashed what
+    uint64_t final_hash = combine_leaves(leaf_hashes, leaf_count(size), size);
+    profile_span("combine", join_end, now_seconds());
+
+    free(leaf_hashes);
+    free(chunk_ids);
+
+    return final_hash;
+}
+
+// --first-touch: opens the file and reserves an untouched buffer the size of
+// it - no page is backed until a worker reads into it
+int reserve_file(const char *filename, FileBuffer *fb, int *fd_out) {
+    double start = now_seconds();
+
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        printf("Error: Cannot open file\n");
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        printf("Error: Cannot stat file\n");
+        close(fd);
+        return -1;
+    }
+
+    fb->size = st.st_size;
+    fb->is_mapped = 0;
+    fb->data = alloc_buffer(fb->size);
+    if (fb->data == NULL) {
+        printf("Error: out of memory\n");
+        close(fd);
+        return -1;
+    }
+
+    *fd_out = fd;
+
+    profile_span("open/size", start, now_seconds());
+
+    return 0;
+}
+
+uint64_t hash_file_multi_threaded(const char *filename, int num_threads) {
+    // first, get the file into memory (copied or mapped) - or with
+    // --first-touch just reserve the memory and let each worker read its part
+    FileBuffer fb;
+    int fd = -1;
+    int first_touch = config.first_touch && config.input_mode == INPUT_READ &&
+                      !config.work_stealing;
+    if (first_touch) {
+        if (reserve_file(filename, &fb, &fd) != 0) {
+            return 0;
+        }
+    } else if (load_file(filename, &fb) != 0) {
+        return 0;
+    }
+
+    if (config.work_stealing) {
+        uint64_t hash = hash_buffer_work_stealing(fb.data, fb.size, num_threads);
+        release_file(&fb);
+        return hash;
+    }
+
+    uint8_t *buffer = fb.data;
+    size_t file_size = fb.size;
+
+    uint64_t *leaf_hashes = malloc((leaf_count(file_size) + 1) * sizeof(uint64_t));
+    if (leaf_hashes == NULL) {
+        printf("Error: out of memory\n");
+        release_file(&fb);
+        return 0;
+    }
+
+    // next, determine the start position for each thread - every thread gets
+    // the same number of whole leaves
+    int i = 0;
+    size_t num_leaves = leaf_count(file_size);
+    size_t leaves_per_thread = (num_leaves + num_threads - 1) / num_threads;
+    size_t chunk_size = leaves_per_thread * LEAF_SIZE;
+
+    // set up thread data array
+    ThreadData thread_data[num_threads];
+    pthread_t threads[num_threads];
+
+    while (i < num_threads) {
+        size_t final_chunk_size = chunk_size;
+
+        // get the start position in the buffer for this chunk
+        size_t start_pos = chunk_size * i;
+        // then calc the end position of this chunk based off default chunk size
+        size_t end_pos = start_pos + chunk_size; 
+
+        // more threads than leaves - the spare ones get an empty slice at the
+        // end, so no pointer runs past the buffer or the leaf array
+        size_t first_leaf = leaves_per_thread * i;
+        if (start_pos >= file_size) {
+            final_chunk_size = 0;
+            start_pos = file_size;
+            first_leaf = num_leaves;
+        } else if (end_pos > file_size) {
+            final_chunk_size = file_size - start_pos;
+        }
+
+        // in mmap mode this points straight into the mapping - no copy
+        thread_data[i].data = buffer + start_pos;
+        thread_data[i].thread_id = i;
+        thread_data[i].size = final_chunk_size;
+        thread_data[i].leaf_hashes = leaf_hashes + first_leaf;
+        thread_data[i].fd = fd;
+        thread_data[i].offset = start_pos;
+        thread_data[i].failed = 0;
+
+        i++;
+    }
+
+    // create threads
+    double spawn_start = now_seconds();
+    for (int i = 0; i < num_threads; i++) {
+        pthread_create(&threads[i], NULL, slice_worker_thread, &thread_data[i]);
+    }
+    double join_start = now_seconds();
+    profile_span("spawn", spawn_start, join_start);
+
+    int read_failed = 0;
+    for (int i = 0; i < num_threads; i++) {
+        pthread_join(threads[i], NULL);
+        read_failed |= thread_data[i].failed;
+    }
+    double join_end = now_seconds();
+    profile_span("join", join_start, join_end);
+    profile_phase(num_threads, join_end - spawn_start);
+
+    uint64_t final_hash = 0;
+    if (read_failed) {
+        printf("Error: Could not read entire file\n");
+    } else {
+        final_hash = combine_leaves(leaf_hashes, leaf_count(file_size), file_size);
+    }
+    double combine_end = now_seconds();
+    profile_span("combine", join_end, combine_end);
+
+    free(leaf_hashes);
+    release_file(&fb);
+    if (fd >= 0) {
+        close(fd);
+    }
+    profile_span("release", combine_end, now_seconds());
+
+    return final_hash;
+}
+
+BlockQueue* create_block_queue(int capacity) {
+    BlockQueue *q = malloc(sizeof(BlockQueue));
+    if (q == NULL) {
+        return NULL;
+    }
+
+    q->items = malloc(capacity * sizeof(Block *));
+    if (q->items == NULL) {
+        free(q);
+        return NULL;
+    }
+
+    q->capacity = capacity;
+    q->size = 0;
+    q->head = 0;
+    q->tail = 0;
+
+    pthread_mutex_init(&q->mutex, NULL);
+    pthread_cond_init(&q->not_full, NULL);
+    pthread_cond_init(&q->not_empty, NULL);
+
+    return q;
+}
+
+void push_block(BlockQueue *q, Block *block) {
+    pthread_mutex_lock(&q->mutex);
+
+    while (q->size == q->capacity) {
+        pthread_cond_wait(&q->not_full, &q->mutex);
+    }
+
+    q->items[q->head] = block;
+    q->head = (q->head + 1) % q->capacity;
+    q->size += 1;
+
+    pthread_cond_signal(&q->not_empty);
+    pthread_mutex_unlock(&q->mutex);
+}
+
+Block* pop_block(BlockQueue *q) {
+    pthread_mutex_lock(&q->mutex);
+
+    while (q->size == 0) {
+        pthread_cond_wait(&q->not_empty, &q->mutex);
+    }
+
+    Block *block = q->items[q->tail];
+    q->tail = (q->tail + 1) % q->capacity;
+    q->size -= 1;
+
+    pthread_cond_signal(&q->not_full);
+    pthread_mutex_unlock(&q->mutex);
+
+    return block;
+}
+
+// like pop_block, but returns NULL straight away if the queue is empty
+// (so a NULL end-of-data marker can't be told apart - only use it on the free queue)
+Block* try_pop_block(BlockQueue *q) {
+    Block *block = NULL;
+
+    pthread_mutex_lock(&q->mutex);
+
+    if (q->size > 0) {
+        block = q->items[q->tail];
+        q->tail = (q->tail + 1) % q->capacity;
+        q->size -= 1;
+        pthread_cond_signal(&q->not_full);
+    }
+
+    pthread_mutex_unlock(&q->mutex);
+
+    return block;
+}
+
+void destroy_block_queue(BlockQueue *q) {
+    pthread_mutex_destroy(&q->mutex);
+    pthread_cond_destroy(&q->not_full);
+    pthread_cond_destroy(&q->not_empty);
+    free(q->items);
+    free(q);
+}
+
+// keeps calling read() until the block is full or the file ends -
+// returns the bytes read, or -1 on error
+ssize_t fill_block(int fd, int direct, uint8_t *data, size_t capacity) {
+    size_t filled = 0;
+
+    while (filled < capacity) {
+        ssize_t n = read(fd, data + filled, capacity - filled);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (n == 0) {
+            break; // end of file
+        }
+        filled += n;
+
+        // with O_DIRECT only the tail of the file comes back unaligned, and
+        // reading on from an unaligned offset would fail
+        if (direct && filled % DIRECT_ALIGN != 0) {
+            break;
+        }
+    }
+
+    return filled;
+}
+
+// stores `count` leaf digests starting at leaf number `first`
+void store_leaves(LeafList *list, size_t first, const uint64_t *hashes, size_t count) {
+    pthread_mutex_lock(&list->mutex);
+
+    if (first + count > list->capacity) {
+        size_t capacity = list->capacity * 2;
+        if (capacity < first + count) {
+            capacity = first + count;
+        }
+
+        uint64_t *grown = realloc(list->hashes, capacity * sizeof(uint64_t));
+        if (grown == NULL) {
+            list->failed = 1;
+            pthread_mutex_unlock(&list->mutex);
+            return;
+        }
+
+        list->hashes = grown;
+        list->capacity = capacity;
+    }
+
+    memcpy(list->hashes + first, hashes, count * sizeof(uint64_t));
+    if (first + count > list->count) {
+        list->count = first + count;
+    }
+
+    pthread_mutex_unlock(&list->mutex);
+}
+
+void* stream_worker_thread(void *arg) {
+    StreamWorker *worker = (StreamWorker *)arg;
+
+    pin_worker(worker->thread_id);
+    profile_set_worker(worker->thread_id);
+
+    while (1) {
+        double wait_start = now_seconds();
+        Block *block = pop_block(worker->full);
+        double hash_start = now_seconds();
+        profile_span("wait", wait_start, hash_start); // ... starved: the reader is behind
+        if (block == NULL) {
+            break; // reader has finished
+        }
+
+        uint64_t hashes[LEAVES_PER_BLOCK];
+        hash_leaves(block->data, block->size, hashes);
+        profile_hash(block->size, hash_start, now_seconds());
+        store_leaves(worker->leaves, block->index * LEAVES_PER_BLOCK, hashes, leaf_count(block->size));
+
+        // hand the block back so the reader can refill it
+        push_block(worker->free, block);
+    }
+
+    return NULL;
+}
+
+// the plain reader - one read() at a time. returns 0, or -1 on a read error
+int read_blocks_sync(int fd, int direct, BlockQueue *free_blocks, BlockQueue *full, uint64_t *total_size) {
+    uint64_t index = 0;
+
+    while (1) {
+        double stall_start = now_seconds();
+        Block *block = pop_block(free_blocks);
+        double read_start = now_seconds();
+        profile_span("stall", stall_start, read_start); // ... no free block: hashing is behind
+
+        ssize_t n = fill_block(fd, direct, block->data, STREAM_BLOCK_SIZE);
+        profile_span("read", read_start, now_seconds());
+        if (n <= 0) {
+            push_block(free_blocks, block);
+            return n < 0 ? -1 : 0;
+        }
+
+        // the block holds its own copy now, the cached pages aren't needed
+        drop_range(fd, direct, *total_size, n);
+
+        block->size = n;
+        block->index = index++;
+        *total_size += n;
+        push_block(full, block);
+    }
+}
+
+#ifdef HAVE_IO_URING
+// the io_uring reader - every free block gets a read in flight straight away,
+// and each block goes to the workers the moment its read completes (so blocks
+// can arrive out of order, which the leaf list doesn't mind).
+// returns 0, -1 on a read error, or 1 if io_uring can't be used here
+int read_blocks_uring(int fd, int direct, Block *blocks, int block_count,
+                      BlockQueue *free_blocks, BlockQueue *full, uint64_t *total_size) {
+    // io_uring needs offsets, so pipes and the like use the plain reader
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        return 1;
+    }
+
+    URing ring;
+    if (uring_init(&ring, block_count) != 0) {
+        return 1;
+    }
+
+    // registered buffers let the kernel skip pinning the pages on every read -
+    // not fatal if it fails (e.g. a low RLIMIT_MEMLOCK), plain reads still work
+    struct iovec iov[block_count];
+    for (int i = 0; i < block_count; i++) {
+        iov[i].iov_base = blocks[i].data;
+        iov[i].iov_len = STREAM_BLOCK_SIZE;
+    }
+    int registered = uring_register_buffers(&ring, iov, block_count) == 0;
+
+    uint64_t file_size = st.st_size;
+    uint64_t num_blocks = (file_size + STREAM_BLOCK_SIZE - 1) / STREAM_BLOCK_SIZE;
+    uint64_t next = 0;
+    int in_flight = 0;
+    int failed = 0;
+
+    while ((next < num_blocks || in_flight > 0) && !failed) {
+        // start a read in every block we can get - only block waiting for a
+        // free one if there is nothing in flight to wait on instead
+        while (next < num_blocks) {
+            Block *block = in_flight == 0 ? pop_block(free_blocks) : try_pop_block(free_blocks);
+            if (block == NULL) {
+                break;
+            }
+
+            uint64_t offset = next * STREAM_BLOCK_SIZE;
+            size_t length = file_size - offset < STREAM_BLOCK_SIZE ? file_size - offset : STREAM_BLOCK_SIZE;
+
+            // O_DIRECT lengths must be aligned too - the kernel stops at the
+            // end of the file anyway, and the block has room
+            if (direct) {
+                length = (length + DIRECT_ALIGN - 1) / DIRECT_ALIGN * DIRECT_ALIGN;
+            }
+
+            block->index = next++;
+            block->size = 0;
+            uring_queue_read(&ring, fd, block->data, length, offset,
+                             registered ? (int)(block - blocks) : -1, (uintptr_t)block);
+            in_flight++;
+        }
+
+        double wait_start = now_seconds();
+        if (uring_submit_and_wait(&ring) != 0) {
+            failed = 1;
+            break;
+        }
+        profile_span("read", wait_start, now_seconds());
+
+        uint64_t user_data;
+        int result;
+        while (uring_next_completion(&ring, &user_data, &result)) {
+            Block *block = (Block *)(uintptr_t)user_data;
+            uint64_t offset = block->index * STREAM_BLOCK_SIZE + block->size;
+            size_t wanted = file_size - block->index * STREAM_BLOCK_SIZE;
+            if (wanted > STREAM_BLOCK_SIZE) {
+                wanted = STREAM_BLOCK_SIZE;
+            }
+
+            if (result == -EINTR || result == -EAGAIN) {
+                result = 0; // ... just ask again
+            } else if (result <= 0) {
+                failed = 1; // ... error, or the file shrank
+                in_flight--;
+                push_block(free_blocks, block);
+                continue;
+            }
+
+            block->size += result;
+
+            if (block->size < wanted) {
+                // short read - ask for the rest
+                uring_queue_read(&ring, fd, block->data + block->size, wanted - block->size,
+                                 offset + result, registered ? (int)(block - blocks) : -1,
+                                 (uintptr_t)block);
+            } else {
+                in_flight--;
+                *total_size += block->size;
+                drop_range(fd, direct, block->index * STREAM_BLOCK_SIZE, block->size);
+                push_block(full, block);
+            }
+        }
+    }
+
+    // on failure, wait out the reads still in flight before the blocks are freed
+    while (in_flight > 0 && uring_submit_and_wait(&ring) == 0) {
+        uint64_t user_data;
+        int result;
+        while (uring_next_completion(&ring, &user_data, &result)) {
+            in_flight--;
+        }
+    }
+
+    uring_exit(&ring);
+
+    return failed ? -1 : 0;
+}
+#endif
+
+// the streaming engine on an fd that is already open - it only ever reads
+// forward, so this also works for pipes, sockets and terminals (the io_uring
+// reader needs offsets and falls back to read() for those). memory stays at
+// block_count blocks however much data comes through
+uint64_t hash_fd_streaming(int fd, int direct, int num_threads) {
+    // enough blocks for every worker to have one while the reader fills the
+    // next - io_uring gets a few more so several reads are in flight
+    int block_count = num_threads + 2;
+    if (config.io_backend == IO_URING) {
+        block_count += URING_EXTRA_BLOCKS;
+    }
+
+    // both queues can hold every block plus the end-of-data markers, so
+    // only popping ever blocks
+    BlockQueue *full = create_block_queue(block_count + num_threads);
+    BlockQueue *free_blocks = create_block_queue(block_count);
+    Block *blocks = calloc(block_count, sizeof(Block));
+    if (full == NULL || free_blocks == NULL || blocks == NULL) {
+        printf("Error: out of memory\n");
+        if (full != NULL) destroy_block_queue(full);
+        if (free_blocks != NULL) destroy_block_queue(free_blocks);
+        free(blocks);
+        return 0;
+    }
+
+    // page-aligned so the same pool works for O_DIRECT
+    int out_of_memory = 0;
+    for (int i = 0; i < block_count; i++) {
+        if (config.page_mode == PAGES_NORMAL) {
+            if (posix_memalign((void **)&blocks[i].data, DIRECT_ALIGN, STREAM_BLOCK_SIZE) != 0) {
+                blocks[i].data = NULL;
+            }
+        } else {
+            blocks[i].data = alloc_buffer(STREAM_BLOCK_SIZE);
+        }
+        if (blocks[i].data == NULL) {
+            out_of_memory = 1;
+            break;
+        }
+        push_block(free_blocks, &blocks[i]);
+    }
+
+    uint64_t final_hash = 0;
+
+    LeafList leaves = { NULL, 0, 0, 0, PTHREAD_MUTEX_INITIALIZER };
+
+    if (out_of_memory) {
+        printf("Error: out of memory\n");
+    } else {
+        StreamWorker workers[num_threads];
+        pthread_t threads[num_threads];
+
+        double spawn_start = now_seconds();
+        for (int i = 0; i < num_threads; i++) {
+            workers[i].full = full;
+            workers[i].free = free_blocks;
+            workers[i].leaves = &leaves;
+            workers[i].thread_id = i;
+            pthread_create(&threads[i], NULL, stream_worker_thread, &workers[i]);
+        }
+
+        // this thread is the reader - it waits for an empty block, fills it
+        // and queues it, so reading overlaps with hashing. every block but
+        // the last is full, so blocks always start on a leaf boundary
+        uint64_t total_size = 0;
+        int result = 1;
+        if (config.io_backend == IO_URING) {
+#ifdef HAVE_IO_URING
+            result = read_blocks_uring(fd, direct, blocks, block_count, free_blocks, full, &total_size);
+#endif
+            if (result == 1) {
+                uring_unavailable();
+            }
+        }
+        if (result == 1) {
+            result = read_blocks_sync(fd, direct, free_blocks, full, &total_size);
+        }
+        int read_error = (result != 0);
+
+        // one end-of-data marker per worker
+        for (int i = 0; i < num_threads; i++) {
+            push_block(full, NULL);
+        }
+
+        double join_start = now_seconds();
+        for (int i = 0; i < num_threads; i++) {
+            pthread_join(threads[i], NULL);
+        }
+        double join_end = now_seconds();
+        profile_span("join", join_start, join_end);
+        profile_phase(num_threads, join_end - spawn_start);
+
+        if (read_error) {
+            printf("Error: Could not read entire file\n");
+        } else if (leaves.failed) {
+            printf("Error: out of memory\n");
+        } else {
+            final_hash = combine_leaves(leaves.hashes, leaves.count, total_size);
+            profile_span("combine", join_end, now_seconds());
+        }
+    }
+
+    free(leaves.hashes);
+    pthread_mutex_destroy(&leaves.mutex);
+
+    for (int i = 0; i < block_count; i++) {
+        free_buffer(blocks[i].data, STREAM_BLOCK_SIZE);
+    }
+    free(blocks);
+    destroy_block_queue(full);
+    destroy_block_queue(free_blocks);
+    return final_hash;
+}
+
+uint64_t hash_file_streaming(const char *filename, int num_threads) {
+    int direct;
+    int fd = open_input(filename, &direct);
+    if (fd < 0) {
+        printf("Error: Cannot open file\n");
+        return 0;
+    }
+
+    uint64_t final_hash = hash_fd_streaming(fd, direct, num_threads);
+
+    close(fd);
+
+    return final_hash;
+}
+
+void* pool_thread(void *arg) {
+    ThreadPool *pool = (ThreadPool *)arg;
+
+    while (1) {
+        pthread_mutex_lock(&pool->mutex);
+
+        while (pool->head == NULL && !pool->shutting_down) {
+            pthread_cond_wait(&pool->not_empty, &pool->mutex);
+        }
+
+        // drain the queue before honouring a shutdown
+        if (pool->head == NULL) {
+            pthread_mutex_unlock(&pool->mutex);
+            break;
+        }
+
+        Task *task = pool->head;
+        pool->head = task->next;
+        if (pool->head == NULL) {
+            pool->tail = NULL;
+        }
+
+        pthread_mutex_unlock(&pool->mutex);
+
+        task->func(task->arg);
+        free(task);
+    }
+
+    return NULL;
+}
+
+ThreadPool* create_thread_pool(int num_threads) {
+    ThreadPool *pool = malloc(sizeof(ThreadPool));
+    if (pool == NULL) {
+        return NULL;
+    }
+
+    pool->threads = malloc(num_threads * sizeof(pthread_t));
+    if (pool->threads == NULL) {
+        free(pool);
+        return NULL;
+    }
+
+    pool->num_threads = 0;
+    pool->head = NULL;
+    pool->tail = NULL;
+    pool->shutting_down = 0;
+
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->not_empty, NULL);
+
+    for (int i = 0; i < num_threads; i++) {
+        if (pthread_create(&pool->threads[i], NULL, pool_thread, pool) != 0) {
+            break;
+        }
+        pool->num_threads++;
+    }
+
+    if (pool->num_threads == 0) {
+        pthread_mutex_destroy(&pool->mutex);
+        pthread_cond_destroy(&pool->not_empty);
+        free(pool->threads);
+        free(pool);
+        return NULL;
+    }
+
+    return pool;
+}
+
+// returns 0 on success, -1 if the task could not be queued
+int pool_submit(ThreadPool *pool, void (*func)(void *arg), void *arg) {
+    Task *task = malloc(sizeof(Task));
+    if (task == NULL) {
+        return -1;
+    }
+
+    task->func = func;
+    task->arg = arg;
+    task->next = NULL;
+
+    pthread_mutex_lock(&pool->mutex);
+
+    if (pool->tail == NULL) {
+        pool->head = task;
+    } else {
+        pool->tail->next = task;
+    }
+    pool->tail = task;
+
+    pthread_cond_signal(&pool->not_empty);
+    pthread_mutex_unlock(&pool->mutex);
+
+    return 0;
+}
+
+// waits for every queued task to run, then stops the threads
+void destroy_thread_pool(ThreadPool *pool) {
+    pthread_mutex_lock(&pool->mutex);
+    pool->shutting_down = 1;
+    pthread_cond_broadcast(&pool->not_empty);
+    pthread_mutex_unlock(&pool->mutex);
+
+    for (int i = 0; i < pool->num_threads; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+
+    pthread_mutex_destroy(&pool->mutex);
+    pthread_cond_destroy(&pool->not_empty);
+    free(pool->threads);
+    free(pool);
+}
+
+// marks `count` chunks of the job as done (or the whole job as failed)
+void finish_chunks(HashJob *job, int count, int failed) {
+    // read before unlocking - once a waiter sees finished it frees the job
+    void (*on_done)(HashJob *job) = job->on_done;
+    int finished_now = 0;
+
+    pthread_mutex_lock(&job->mutex);
+
+    job->remaining -= count;
+    if (failed) {
+        job->failed = 1;
+    }
+    if (job->remaining <= 0) {
+        job->finished = 1;
+        finished_now = 1;
+        pthread_cond_broadcast(&job->done);
+    }
+
+    pthread_mutex_unlock(&job->mutex);
+
+    // nobody waits on a job with a callback, so whoever finishes it hands it over
+    if (finished_now && on_done != NULL) {
+        on_done(job);
+    }
+}
+
+void pool_chunk_task(void *arg) {
+    PoolChunk *chunk = (PoolChunk *)arg;
+
+    worker_thread(&chunk->data);
+
+    finish_chunks(chunk->job, 1, 0);
+}
+
+// first task of every job - loads the file on a pool thread (so the caller
+// never blocks on I/O) and then queues one task per chunk
+void pool_load_task(void *arg) {
+    HashJob *job = (HashJob *)arg;
+
+    if (load_file(job->filename, &job->fb) != 0) {
+        finish_chunks(job, 1, 1);
+        return;
+    }
+
+    // small files are a single chunk, big ones are split so every thread helps
+    size_t chunk_size = round_to_leaves(config.chunk_size);
+    int num_chunks = 1;
+    if (job->fb.size > chunk_size) {
+        num_chunks = (job->fb.size + chunk_size - 1) / chunk_size;
+    }
+
+    job->chunks = calloc(num_chunks, sizeof(PoolChunk));
+    job->leaf_hashes = malloc((leaf_count(job->fb.size) + 1) * sizeof(uint64_t));
+    if (job->chunks == NULL || job->leaf_hashes == NULL) {
+        printf("Error: out of memory\n");
+        finish_chunks(job, 1, 1);
+        return;
+    }
+
+    job->num_chunks = num_chunks;
+
+    // the load task itself counts as one chunk until every real chunk is queued,
+    // so a fast worker cannot finish the job while we are still submitting
+    pthread_mutex_lock(&job->mutex);
+    job->remaining += num_chunks;
+    pthread_mutex_unlock(&job->mutex);
+
+    int submitted = 0;
+    for (int i = 0; i < num_chunks; i++) {
+        size_t start = (size_t)i * chunk_size;
+        size_t size = job->fb.size - start;
+        if (size > chunk_size) {
+            size = chunk_size;
+        }
+
+        job->chunks[i].data.data = job->fb.data + start;
+        job->chunks[i].data.size = size;
+        job->chunks[i].data.leaf_hashes = job->leaf_hashes + start / LEAF_SIZE;
+        job->chunks[i].data.thread_id = i;
+        job->chunks[i].job = job;
+
+        if (pool_submit(job->pool, pool_chunk_task, &job->chunks[i]) != 0) {
+            break;
+        }
+        submitted++;
+    }
+
+    if (submitted < num_chunks) {
+        printf("Error: out of memory\n");
+        finish_chunks(job, num_chunks - submitted, 1);
+    }
+
+    finish_chunks(job, 1, 0);
+}
+
+// like submit_file, but instead of anyone calling wait_file(), on_done is
+// called on a pool thread when the job finishes and must free it with free_job()
+HashJob* submit_file_with_callback(ThreadPool *pool, const char *filename,
+                                   void (*on_done)(HashJob *job), void *owner) {
+    HashJob *job = calloc(1, sizeof(HashJob));
+    if (job == NULL) {
+        return NULL;
+    }
+
+    job->filename = strdup(filename);
+    if (job->filename == NULL) {
+        free(job);
+        return NULL;
+    }
+
+    job->pool = pool;
+    job->remaining = 1; // ... the load task
+    job->on_done = on_done;
+    job->owner = owner;
+    pthread_mutex_init(&job->mutex, NULL);
+    pthread_cond_init(&job->done, NULL);
+
+    if (pool_submit(pool, pool_load_task, job) != 0) {
+        pthread_mutex_destroy(&job->mutex);
+        pthread_cond_destroy(&job->done);
+        free(job->filename);
+        free(job);
+        return NULL;
+    }
+
+    return job;
+}
+
+// queues a file for hashing and returns straight away - pass the result to
+// wait_file() to get the hash. returns NULL if the job could not be queued
+HashJob* submit_file(ThreadPool *pool, const char *filename) {
+    return submit_file_with_callback(pool, filename, NULL, NULL);
+}
+
+// digest of a finished job (0 on error)
+uint64_t job_digest(HashJob *job) {
+    if (job->failed) {
+        return 0;
+    }
+
+    return combine_leaves(job->leaf_hashes, leaf_count(job->fb.size), job->fb.size);
+}
+
+void free_job(HashJob *job) {
+    release_file(&job->fb);
+    pthread_mutex_destroy(&job->mutex);
+    pthread_cond_destroy(&job->done);
+    free(job->chunks);
+    free(job->leaf_hashes);
+    free(job->filename);
+    free(job);
+}
+
+// blocks until the job is done, frees it and returns the hash (0 on error)
+uint64_t wait_file(HashJob *job) {
+    pthread_mutex_lock(&job->mutex);
+    while (!job->finished) {
+        pthread_cond_wait(&job->done, &job->mutex);
+    }
+    pthread_mutex_unlock(&job->mutex);
+
+    uint64_t final_hash = job_digest(job);
+
+    free_job(job);
+
+    return final_hash;
+}
+
+// hashes every file with one pool - all files are in flight at once
+int run_pool(const char **files, int num_files, int num_threads) {
+    double start = now_seconds();
+
+    ThreadPool *pool = create_thread_pool(num_threads);
+    if (pool == NULL) {
+        printf("Error: Cannot create thread pool\n");
+        return 1;
+    }
+
+    HashJob **jobs = malloc(num_files * sizeof(HashJob *));
+    if (jobs == NULL) {
+        printf("Error: out of memory\n");
+        destroy_thread_pool(pool);
+        return 1;
+    }
+
+    for (int i = 0; i < num_files; i++) {
+        jobs[i] = submit_file(pool, files[i]);
+    }
+
+    for (int i = 0; i < num_files; i++) {
+        if (jobs[i] == NULL) {
+            printf("%s: Error: could not queue file\n", files[i]);
+            continue;
+        }
+        printf("%s: %llu\n", files[i], (unsigned long long)wait_file(jobs[i]));
+    }
+
+    free(jobs);
+    destroy_thread_pool(pool);
+
+    double time_spent = now_seconds() - start;
+    printf("Hashed %d files with a pool of %d threads in %.3f seconds\n",
+           num_files, num_threads, time_spent);
+
+    return 0;
+}
+
+// ========== directory mode ==========
+// one pool, one queue: directory listings, batches of small files and the
+// chunks of big files all run as tasks, so many files are in flight at once
+
+void walk_begin(DirWalk *walk) {
+    pthread_mutex_lock(&walk->mutex);
+    walk->outstanding++;
+    pthread_mutex_unlock(&walk->mutex);
+}
+
+void walk_end(DirWalk *walk) {
+    pthread_mutex_lock(&walk->mutex);
+    walk->outstanding--;
+    if (walk->outstanding == 0) {
+        pthread_cond_broadcast(&walk->done);
+    }
+    pthread_mutex_unlock(&walk->mutex);
+}
+
+void walk_error(DirWalk *walk, const char *path, const char *what) {
+    pthread_mutex_lock(&walk->mutex);
+    walk->errors++;
+    fprintf(stderr, "Error: %s '%s'\n", what, path);
+    pthread_mutex_unlock(&walk->mutex);
+}
+
+// takes ownership of path
+void record_entry(DirWalk *walk, char *path, uint64_t size, uint64_t digest) {
+    pthread_mutex_lock(&walk->mutex);
+
+    if (walk->count == walk->capacity) {
+        size_t capacity = walk->capacity ? walk->capacity * 2 : 1024;
+        ManifestEntry *grown = realloc(walk->entries, capacity * sizeof(ManifestEntry));
+        if (grown == NULL) {
+            walk->errors++;
+            pthread_mutex_unlock(&walk->mutex);
+            free(path);
+            return;
+        }
+        walk->entries = grown;
+        walk->capacity = capacity;
+    }
+
+    walk->entries[walk->count].path = path;
+    walk->entries[walk->count].size = size;
+    walk->entries[walk->count].digest = digest;
+    walk->count++;
+
+    pthread_mutex_unlock(&walk->mutex);
+}
+
+// a split file has finished on the pool - runs on whichever thread finished it
+void big_file_done(HashJob *job) {
+    DirWalk *walk = (DirWalk *)job->owner;
+
+    if (job->failed) {
+        walk_error(walk, job->filename, "Cannot hash");
+    } else {
+        record_entry(walk, strdup(job->filename), job->fb.size, job_digest(job));
+    }
+
+    free_job(job);
+    walk_end(walk);
+}
+
+void hash_batch_task(void *arg) {
+    FileBatch *batch = (FileBatch *)arg;
+    DirWalk *walk = batch->walk;
+
+    // one buffer for the whole batch, grown as needed
+    uint8_t *buffer = NULL;
+    size_t capacity = 0;
+    uint64_t leaf_hashes[BATCH_MAX_BYTES / LEAF_SIZE + 2];
+
+    for (int i = 0; i < batch->count; i++) {
+        char *path = batch->paths[i];
+
+        int fd = open(path, O_RDONLY);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0) {
+            walk_error(walk, path, "Cannot open file");
+            if (fd >= 0) close(fd);
+            free(path);
+            continue;
+        }
+
+        // the file may have grown since it was listed - too big for the batch
+        // now, so hand it to the split path rather than hash part of it
+        size_t size = st.st_size;
+        if (size > BATCH_MAX_BYTES) {
+            close(fd);
+            walk_begin(walk);
+            if (submit_file_with_callback(walk->pool, path, big_file_done, walk) == NULL) {
+                walk_error(walk, path, "Cannot queue");
+                walk_end(walk);
+            }
+            free(path);
+            continue;
+        }
+
+        if (size > capacity) {
+            uint8_t *grown = realloc(buffer, size);
+            if (grown == NULL) {
+                walk_error(walk, path, "Out of memory for");
+                close(fd);
+                free(path);
+                continue;
+            }
+            buffer = grown;
+            capacity = size;
+        }
+
+        ssize_t n = fill_block(fd, 0, buffer, size);
+        close(fd);
+        if (n < 0) {
+            walk_error(walk, path, "Cannot read file");
+            free(path);
+            continue;
+        }
+
+        hash_leaves(buffer, n, leaf_hashes);
+        record_entry(walk, path, n, combine_leaves(leaf_hashes, leaf_count(n), n));
+    }
+
+    free(buffer);
+    free(batch);
+    walk_end(walk);
+}
+
+// queues a task that counts towards the walk - returns -1 if it couldn't
+int walk_submit(DirWalk *walk, void (*func)(void *arg), void *arg) {
+    walk_begin(walk);
+
+    if (pool_submit(walk->pool, func, arg) != 0) {
+        walk_end(walk);
+        return -1;
+    }
+
+    return 0;
+}
+
+void flush_batch(DirWalk *walk, FileBatch **batch) {
+    if (*batch == NULL) {
+        return;
+    }
+
+    if (walk_submit(walk, hash_batch_task, *batch) != 0) {
+        for (int i = 0; i < (*batch)->count; i++) {
+            walk_error(walk, (*batch)->paths[i], "Cannot queue");
+            free((*batch)->paths[i]);
+        }
+        free(*batch);
+    }
+
+    *batch = NULL;
+}
+
+void submit_dir(DirWalk *walk, char *path);
+
+void scan_dir_task(void *arg) {
+    DirTask *task = (DirTask *)arg;
+    DirWalk *walk = task->walk;
+    // anything over BATCH_MAX_BYTES is split whatever the chunk size - the
+    // batch path can only hold that much of one file
+    size_t big_file = round_to_leaves(config.chunk_size);
+    if (big_file > BATCH_MAX_BYTES) {
+        big_file = BATCH_MAX_BYTES;
+    }
+
+    DIR *dir = opendir(task->path);
+    if (dir == NULL) {
+        walk_error(walk, task->path, "Cannot open directory");
+        free(task->path);
+        free(task);
+        walk_end(walk);
+        return;
+    }
+
+    FileBatch *batch = NULL;
+    struct dirent *entry;
+
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+
+        size_t length = strlen(task->path) + strlen(entry->d_name) + 2;
+        char *path = malloc(length);
+        if (path == NULL) {
+            walk_error(walk, entry->d_name, "Out of memory for");
+            continue;
+        }
+        snprintf(path, length, "%s/%s", task->path, entry->d_name);
+
+        // lstat so symlinks are skipped rather than followed into loops
+        struct stat st;
+        if (lstat(path, &st) != 0) {
+            walk_error(walk, path, "Cannot stat");
+            free(path);
+        } else if (S_ISDIR(st.st_mode)) {
+            submit_dir(walk, path);
+        } else if (!S_ISREG(st.st_mode)) {
+            free(path);
+        } else if ((size_t)st.st_size > big_file) {
+            // big file - split across the whole pool
+            walk_begin(walk);
+            if (submit_file_with_callback(walk->pool, path, big_file_done, walk) == NULL) {
+                walk_error(walk, path, "Cannot queue");
+                walk_end(walk);
+            }
+            free(path);
+        } else {
+            // small file - batched so one task covers many of them
+            if (batch != NULL && batch->bytes + st.st_size > BATCH_MAX_BYTES) {
+                flush_batch(walk, &batch);
+            }
+            if (batch == NULL) {
+                batch = calloc(1, sizeof(FileBatch));
+                if (batch == NULL) {
+                    walk_error(walk, path, "Out of memory for");
+                    free(path);
+                    continue;
+                }
+                batch->walk = walk;
+            }
+
+            batch->paths[batch->count++] = path;
+            batch->bytes += st.st_size;
+            if (batch->count == BATCH_MAX_FILES) {
+                flush_batch(walk, &batch);
+            }
+        }
+    }
+
+    flush_batch(walk, &batch);
+    closedir(dir);
+
+    free(task->path);
+    free(task);
+    walk_end(walk);
+}
+
+// takes ownership of path
+void submit_dir(DirWalk *walk, char *path) {
+    DirTask *task = malloc(sizeof(DirTask));
+    if (task == NULL) {
+        walk_error(walk, path, "Out of memory for");
+        free(path);
+        return;
+    }
+
+    task->walk = walk;
+    task->path = path;
+
+    if (walk_submit(walk, scan_dir_task, task) != 0) {
+        walk_error(walk, path, "Cannot queue");
+        free(task);
+        free(path);
+    }
+}
+
+int compare_entries(const void *a, const void *b) {
+    return strcmp(((const ManifestEntry *)a)->path, ((const ManifestEntry *)b)->path);
+}
+
+// hashes every regular file under the given directories and writes a
+// "digest size path" manifest, sorted by path so runs can be diffed
+int run_dir_walk(const char **dirs, int num_dirs, int num_threads, const char *manifest_path) {
+    double start = now_seconds();
+
+    DirWalk walk;
+    memset(&walk, 0, sizeof(walk));
+    pthread_mutex_init(&walk.mutex, NULL);
+    pthread_cond_init(&walk.done, NULL);
+
+    walk.pool = create_thread_pool(num_threads);
+    if (walk.pool == NULL) {
+        printf("Error: Cannot create thread pool\n");
+        return 1;
+    }
+
+    // hold one count ourselves so the walk can't look finished while the
+    // roots are still being queued
+    walk_begin(&walk);
+    for (int i = 0; i < num_dirs; i++) {
+        char *path = strdup(dirs[i]);
+        if (path == NULL) {
+            walk_error(&walk, dirs[i], "Out of memory for");
+            continue;
+        }
+        submit_dir(&walk, path);
+    }
+    walk_end(&walk);
+
+    pthread_mutex_lock(&walk.mutex);
+    while (walk.outstanding > 0) {
+        pthread_cond_wait(&walk.done, &walk.mutex);
+    }
+    pthread_mutex_unlock(&walk.mutex);
+
+    destroy_thread_pool(walk.pool);
+
+    double elapsed = now_seconds() - start;
+
+    qsort(walk.entries, walk.count, sizeof(ManifestEntry), compare_entries);
+
+    FILE *out = stdout;
+    if (manifest_path != NULL) {
+        out = fopen(manifest_path, "w");
+        if (out == NULL) {
+            printf("Error: Cannot write manifest '%s'\n", manifest_path);
+            out = stdout;
+        }
+    }
+
+    uint64_t total_bytes = 0;
+    for (size_t i = 0; i < walk.count; i++) {
+        fprintf(out, "%016llx %llu %s\n", (unsigned long long)walk.entries[i].digest,
+                (unsigned long long)walk.entries[i].size, walk.entries[i].path);
+        total_bytes += walk.entries[i].size;
+        free(walk.entries[i].path);
+    }
+
+    if (out != stdout) {
+        fclose(out);
+    }
+
+    printf("Hashed %zu files (%llu bytes) in %.3f seconds, %.1f MB/s, %zu errors\n",
+           walk.count, (unsigned long long)total_bytes, elapsed,
+           total_bytes / (1024.0 * 1024.0) / elapsed, walk.errors);
+
+    free(walk.entries);
+    pthread_mutex_destroy(&walk.mutex);
+    pthread_cond_destroy(&walk.done);
+
+    return walk.errors > 0 ? 1 : 0;
+}
+
+// runs the single and multi-threaded hash in both modes and prints the
+// throughput of each, and whether the thread count changed the digest
+int compare_hash_modes(const char *filename, int num_threads) {
+    HashMode saved_mode = config.hash_mode;
+    int saved_verbose = config.verbose;
+    HashMode modes[2] = { HASH_SUM, HASH_TREE };
+    const char *names[2] = { "sum", "tree" };
+
+    struct stat st;
+    if (stat(filename, &st) != 0) {
+        printf("Error: Cannot open file\n");
+        return 1;
+    }
+    double megabytes = st.st_size / (1024.0 * 1024.0);
+
+    config.verbose = 0;
+
+    printf("\n%-6s %-9s %20s %12s\n", "mode", "threads", "digest", "MB/s");
+    for (int m = 0; m < 2; m++) {
+        config.hash_mode = modes[m];
+
+        double start = now_seconds();
+        uint64_t single = hash_file_single_threaded(filename);
+        double single_time = now_seconds() - start;
+
+        start = now_seconds();
+        uint64_t multi = hash_file_multi_threaded(filename, num_threads);
+        double multi_time = now_seconds() - start;
+
+        printf("%-6s %-9d %20llu %12.1f\n", names[m], 1,
+               (unsigned long long)single, megabytes / single_time);
+        printf("%-6s %-9d %20llu %12.1f %s\n", names[m], num_threads,
+               (unsigned long long)multi, megabytes / multi_time,
+               single == multi ? "(match)" : "(MISMATCH)");
+    }
+
+    config.hash_mode = saved_mode;
+    config.verbose = saved_verbose;
+
+    return 0;
+}
+
+// ========== incremental mode ==========
+// keeps the leaf digests of the last run in <file>.hidx. if size, mtime,
+// ctime and inode all still match, nothing is read at all. if the file did
+// change, metadata alone can't say where, so:
+//  - if the caller lists the ranges it wrote (--dirty=), those are trusted:
+//    only the leaves they cover are re-read, plus any past the old end
+//  - else if the file only grew, it is taken to have been appended to: the
+//    leaves wholly below the old end are kept, the rest re-read
+//  - else the whole file is re-hashed
+// listed ranges are re-read even when the file looks unchanged, for writers
+// that put the old mtime back
+
+void fill_index_header(IndexHeader *h, const struct stat *st) {
+    memset(h, 0, sizeof(*h));
+    h->magic = INDEX_MAGIC;
+    h->version = INDEX_VERSION;
+    h->hash_mode = config.hash_mode;
+    h->leaf_size = LEAF_SIZE;
+    h->file_size = st->st_size;
+    h->inode = st->st_ino;
+    h->device = st->st_dev;
+    h->mtime_sec = st->st_mtim.tv_sec;
+    h->mtime_nsec = st->st_mtim.tv_nsec;
+    h->ctime_sec = st->st_ctim.tv_sec;
+    h->ctime_nsec = st->st_ctim.tv_nsec;
+    h->num_leaves = leaf_count(st->st_size);
+}
+
+// loads the index into *leaf_hashes (malloc'd) - returns -1 if there is no
+// usable index for this file
+int load_index(const char *index_path, IndexHeader *h, uint64_t **leaf_hashes) {
+    FILE *fp = fopen(index_path, "rb");
+    if (fp == NULL) {
+        return -1;
+    }
+
+    if (fread(h, sizeof(*h), 1, fp) != 1 || h->magic != INDEX_MAGIC ||
+        h->version != INDEX_VERSION || h->hash_mode != (uint32_t)config.hash_mode ||
+        h->leaf_size != LEAF_SIZE || h->num_leaves != leaf_count(h->file_size)) {
+        fclose(fp);
+        return -1;
+    }
+
+    *leaf_hashes = malloc((h->num_leaves + 1) * sizeof(uint64_t));
+    if (*leaf_hashes == NULL ||
+        fread(*leaf_hashes, sizeof(uint64_t), h->num_leaves, fp) != h->num_leaves) {
+        free(*leaf_hashes);
+        *leaf_hashes = NULL;
+        fclose(fp);
+        return -1;
+    }
+
+    fclose(fp);
+    return 0;
+}
+
+// writes to a temporary file and renames it, so a crash never leaves a
+// half-written index behind
+int save_index(const char *index_path, const IndexHeader *h, const uint64_t *leaf_hashes) {
+    size_t length = strlen(index_path) + 5;
+    char *tmp_path = malloc(length);
+    if (tmp_path == NULL) {
+        return -1;
+    }
+    snprintf(tmp_path, length, "%s.tmp", index_path);
+
+    FILE *fp = fopen(tmp_path, "wb");
+    if (fp == NULL) {
+        free(tmp_path);
+        return -1;
+    }
+
+    int ok = fwrite(h, sizeof(*h), 1, fp) == 1 &&
+             fwrite(leaf_hashes, sizeof(uint64_t), h->num_leaves, fp) == h->num_leaves;
+    ok = (fclose(fp) == 0) && ok;
+
+    if (!ok || rename(tmp_path, index_path) != 0) {
+        unlink(tmp_path);
+        free(tmp_path);
+        return -1;
+    }
+
+    free(tmp_path);
+    return 0;
+}
+
+void* rehash_worker_thread(void *arg) {
+    RehashWorker *w = (RehashWorker *)arg;
+
+    uint8_t *buffer = malloc(LEAF_SIZE);
+    if (buffer == NULL) {
+        w->failed = 1;
+        return NULL;
+    }
+
+    for (size_t i = 0; i < w->count; i++) {
+        uint64_t offset = (uint64_t)w->leaves[i] * LEAF_SIZE;
+        size_t size = LEAF_SIZE;
+        if (offset + size > w->file_size) {
+            size = w->file_size - offset;
+        }
+
+        ssize_t n = pread_full(w->fd, buffer, size, offset);
+        if (n != (ssize_t)size) {
+            w->failed = 1; // ... error, or the file shrank under us
+            break;
+        }
+
+        w->leaf_hashes[w->leaves[i]] = hash_leaf(buffer, size);
+    }
+
+    free(buffer);
+    return NULL;
+}
+
+// hashes the file re-using whatever the index says is still valid, then
+// rewrites the index. returns 0 and fills `digest` and `rehashed` (the number
+// of leaves actually read), or -1 on error
+int hash_file_incremental(const char *filename, int num_threads, const DirtyRange *dirty,
+                          int num_dirty, uint64_t *digest, size_t *rehashed) {
+    *digest = 0;
+    *rehashed = 0;
+
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        printf("Error: Cannot open file\n");
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        printf("Error: Cannot stat file\n");
+        close(fd);
+        return -1;
+    }
+
+    size_t length = strlen(filename) + strlen(INDEX_SUFFIX) + 1;
+    char *index_path = malloc(length);
+    if (index_path == NULL) {
+        printf("Error: out of memory\n");
+        close(fd);
+        return -1;
+    }
+    snprintf(index_path, length, "%s%s", filename, INDEX_SUFFIX);
+
+    IndexHeader now;
+    fill_index_header(&now, &st);
+
+    IndexHeader old;
+    uint64_t *old_hashes = NULL;
+    int have_index = load_index(index_path, &old, &old_hashes) == 0 &&
+                     old.inode == now.inode && old.device == now.device;
+
+    size_t num_leaves = now.num_leaves;
+    uint64_t *leaf_hashes = calloc(num_leaves + 1, sizeof(uint64_t));
+    uint8_t *stale = calloc(num_leaves + 1, 1); // ... 1 = must be re-read
+    if (leaf_hashes == NULL || stale == NULL) {
+        printf("Error: out of memory\n");
+        free(leaf_hashes);
+        free(stale);
+        free(old_hashes);
+        free(index_path);
+        close(fd);
+        return -1;
+    }
+
+    int unchanged = have_index && old.file_size == now.file_size &&
+                    old.mtime_sec == now.mtime_sec && old.mtime_nsec == now.mtime_nsec &&
+                    old.ctime_sec == now.ctime_sec && old.ctime_nsec == now.ctime_nsec;
+    // see the top of this section for when a changed file's leaves are kept
+    int trusted = have_index && (unchanged || num_dirty > 0 || now.file_size > old.file_size);
+
+    for (size_t i = 0; i < num_leaves; i++) {
+        // a leaf is reusable only if it is full size both then and now - the
+        // old last leaf may have been short, and a shrunk file's new one is
+        int cached = have_index && i < old.num_leaves &&
+                     (uint64_t)(i + 1) * LEAF_SIZE <= old.file_size &&
+                     (uint64_t)(i + 1) * LEAF_SIZE <= now.file_size;
+        if (have_index && i == old.num_leaves - 1 && old.file_size == now.file_size) {
+            cached = 1; // ... same size, so the short last leaf is the same length
+        }
+
+        if (cached && trusted) {
+            leaf_hashes[i] = old_hashes[i];
+        } else {
+            stale[i] = 1;
+        }
+    }
+
+    // the caller's written ranges are always re-read
+    for (int r = 0; r < num_dirty; r++) {
+        if (dirty[r].length == 0 || dirty[r].offset >= now.file_size) {
+            continue;
+        }
+        uint64_t last = dirty[r].offset + dirty[r].length - 1;
+        if (last >= now.file_size) {
+            last = now.file_size - 1;
+        }
+        for (uint64_t leaf = dirty[r].offset / LEAF_SIZE; leaf <= last / LEAF_SIZE; leaf++) {
+            stale[leaf] = 1;
+        }
+    }
+
+    size_t *todo = malloc((num_leaves + 1) * sizeof(size_t));
+    size_t num_todo = 0;
+    if (todo == NULL) {
+        printf("Error: out of memory\n");
+        free(leaf_hashes);
+        free(stale);
+        free(old_hashes);
+        free(index_path);
+        close(fd);
+        return -1;
+    }
+    for (size_t i = 0; i < num_leaves; i++) {
+        if (stale[i]) {
+            todo[num_todo++] = i;
+        }
+    }
+
+    // re-read the stale leaves in parallel, each thread with its own share
+    int failed = 0;
+    if (num_todo > 0) {
+        if ((size_t)num_threads > num_todo) {
+            num_threads = num_todo;
+        }
+
+        RehashWorker workers[num_threads];
+        pthread_t threads[num_threads];
+
+        for (int i = 0; i < num_threads; i++) {
+            size_t first = num_todo * i / num_threads;
+            size_t last = num_todo * (i + 1) / num_threads;
+
+            workers[i].fd = fd;
+            workers[i].leaves = todo + first;
+            workers[i].count = last - first;
+            workers[i].file_size = now.file_size;
+            workers[i].leaf_hashes = leaf_hashes;
+            workers[i].failed = 0;
+            pthread_create(&threads[i], NULL, rehash_worker_thread, &workers[i]);
+        }
+
+        for (int i = 0; i < num_threads; i++) {
+            pthread_join(threads[i], NULL);
+            failed |= workers[i].failed;
+        }
+    }
+
+    if (failed) {
+        printf("Error: Could not read entire file\n");
+    } else {
+        *rehashed = num_todo;
+        *digest = combine_leaves(leaf_hashes, num_leaves, now.file_size);
+
+        if (save_index(index_path, &now, leaf_hashes) != 0) {
+            printf("Warning: Could not write index '%s'\n", index_path);
+        }
+    }
+
+    free(todo);
+    free(leaf_hashes);
+    free(stale);
+    free(old_hashes);
+    free(index_path);
+    close(fd);
+
+    return failed ? -1 : 0;
+}
+
+// ========== sparse mode ==========
+// asks the filesystem where the data is (SEEK_DATA/SEEK_HOLE) and only reads
+// leaves that touch it. a leaf entirely inside a hole is all zeros, so its
+// digest is worked out once and reused - the digest is exactly what a dense
+// read gives, but a mostly-empty image costs only as much as its data
+
+// marks every leaf that overlaps a data extent - returns the number of
+// extents found, or -1 if the filesystem can't tell (then all leaves are marked)
+long long find_data_leaves(int fd, uint64_t file_size, uint8_t *has_data, uint64_t *data_bytes) {
+    long long extents = 0;
+    uint64_t offset = 0;
+    *data_bytes = 0;
+
+    while (offset < file_size) {
+        off_t data = lseek(fd, offset, SEEK_DATA);
+        if (data < 0) {
+            if (errno == ENXIO) {
+                break; // ... nothing but hole from here to the end
+            }
+            memset(has_data, 1, leaf_count(file_size));
+            *data_bytes = file_size;
+            return -1;
+        }
+
+        off_t hole = lseek(fd, data, SEEK_HOLE);
+        if (hole < 0) {
+            hole = file_size;
+        }
+        if ((uint64_t)hole > file_size) {
+            hole = file_size; // ... the file grew under us
+        }
+
+        for (uint64_t leaf = data / LEAF_SIZE; leaf * LEAF_SIZE < (uint64_t)hole; leaf++) {
+            has_data[leaf] = 1;
+        }
+
+        *data_bytes += hole - data;
+        extents++;
+        offset = hole;
+    }
+
+    return extents;
+}
+
+uint64_t hash_file_sparse(const char *filename, int num_threads) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        printf("Error: Cannot open file\n");
+        return 0;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        printf("Error: Cannot stat file\n");
+        close(fd);
+        return 0;
+    }
+
+    uint64_t file_size = st.st_size;
+    size_t num_leaves = leaf_count(file_size);
+
+    uint64_t *leaf_hashes = malloc((num_leaves + 1) * sizeof(uint64_t));
+    uint8_t *has_data = calloc(num_leaves + 1, 1);
+    size_t *todo = malloc((num_leaves + 1) * sizeof(size_t));
+    uint8_t *zeros = calloc(LEAF_SIZE, 1);
+    if (leaf_hashes == NULL || has_data == NULL || todo == NULL || zeros == NULL) {
+        printf("Error: out of memory\n");
+        free(leaf_hashes);
+        free(has_data);
+        free(todo);
+        free(zeros);
+        close(fd);
+        return 0;
+    }
+
+    uint64_t data_bytes;
+    long long extents = find_data_leaves(fd, file_size, has_data, &data_bytes);
+
+    // every hole leaf gets the all-zero digest - only the last leaf can be short
+    uint64_t zero_leaf = hash_leaf(zeros, LEAF_SIZE);
+    size_t num_todo = 0;
+    for (size_t i = 0; i < num_leaves; i++) {
+        if (has_data[i]) {
+            todo[num_todo++] = i;
+        } else if ((uint64_t)(i + 1) * LEAF_SIZE <= file_size) {
+            leaf_hashes[i] = zero_leaf;
+        } else {
+            leaf_hashes[i] = hash_leaf(zeros, file_size - (uint64_t)i * LEAF_SIZE);
+        }
+    }
+
+    if (config.verbose) {
+        if (extents < 0) {
+            printf("No SEEK_DATA support here, reading every leaf\n");
+        } else {
+            printf("%lld data extents, %llu of %llu bytes - reading %zu of %zu leaves\n",
+                   extents, (unsigned long long)data_bytes, (unsigned long long)file_size,
+                   num_todo, num_leaves);
+        }
+    }
+
+    // the data leaves are read and hashed like the incremental mode's stale
+    // ones - a partial leaf reads back zeros for its hole part
+    int failed = 0;
+    if (num_todo > 0) {
+        if ((size_t)num_threads > num_todo) {
+            num_threads = num_todo;
+        }
+
+        RehashWorker workers[num_threads];
+        pthread_t threads[num_threads];
+
+        for (int i = 0; i < num_threads; i++) {
+            size_t first = num_todo * i / num_threads;
+            size_t last = num_todo * (i + 1) / num_threads;
+
+            workers[i].fd = fd;
+            workers[i].leaves = todo + first;
+            workers[i].count = last - first;
+            workers[i].file_size = file_size;
+            workers[i].leaf_hashes = leaf_hashes;
+            workers[i].failed = 0;
+            pthread_create(&threads[i], NULL, rehash_worker_thread, &workers[i]);
+        }
+
+        for (int i = 0; i < num_threads; i++) {
+            pthread_join(threads[i], NULL);
+            failed |= workers[i].failed;
+        }
+    }
+
+    uint64_t final_hash = 0;
+    if (failed) {
+        printf("Error: Could not read entire file\n");
+    } else {
+        final_hash = combine_leaves(leaf_hashes, num_leaves, file_size);
+    }
+
+    free(leaf_hashes);
+    free(has_data);
+    free(todo);
+    free(zeros);
+    close(fd);
+
+    return final_hash;
+}
+
+// ========== verify mode ==========
+// checks a file against the leaf digests of an earlier --cache run. workers
+// take small batches of leaves in file order and skip every leaf at or past
+// the lowest mismatch seen so far. batches go out in order, so every leaf
+// below it is still checked by someone - the report is the first bad leaf,
+// and a corrupted file fails after reading little more than that leaf
+
+void* verify_worker_thread(void *arg) {
+    VerifyJob *job = (VerifyJob *)arg;
+
+    uint8_t *buffer = malloc(LEAF_SIZE);
+    if (buffer == NULL) {
+        pthread_mutex_lock(&job->mutex);
+        job->read_error = 1;
+        pthread_mutex_unlock(&job->mutex);
+        __atomic_store_n(&job->cancelled, 1, __ATOMIC_RELEASE);
+        return NULL;
+    }
+
+    while (!__atomic_load_n(&job->cancelled, __ATOMIC_ACQUIRE)) {
+        size_t first = __atomic_fetch_add(&job->next_leaf, VERIFY_BATCH_LEAVES, __ATOMIC_RELAXED);
+        if (first >= __atomic_load_n(&job->bad_leaf, __ATOMIC_ACQUIRE)) {
+            break; // ... covers running off the end too, bad_leaf starts at num_leaves
+        }
+
+        size_t last = first + VERIFY_BATCH_LEAVES;
+        if (last > job->num_leaves) {
+            last = job->num_leaves;
+        }
+
+        for (size_t leaf = first; leaf < last; leaf++) {
+            // leaves past a known mismatch don't matter, ones below it still do
+            if (__atomic_load_n(&job->cancelled, __ATOMIC_ACQUIRE) ||
+                leaf >= __atomic_load_n(&job->bad_leaf, __ATOMIC_ACQUIRE)) {
+                break;
+            }
+
+            uint64_t offset = (uint64_t)leaf * LEAF_SIZE;
+            size_t size = LEAF_SIZE;
+            if (offset + size > job->file_size) {
+                size = job->file_size - offset;
+            }
+
+            int read_ok = pread_full(job->fd, buffer, size, offset) == (ssize_t)size;
+            drop_range(job->fd, 0, offset, size);
+
+            if (read_ok && hash_leaf(buffer, size) == job->expected[leaf]) {
+                continue;
+            }
+
+            pthread_mutex_lock(&job->mutex);
+            if (!read_ok) {
+                job->read_error = 1;
+                __atomic_store_n(&job->cancelled, 1, __ATOMIC_RELEASE);
+            } else if (leaf < job->bad_leaf) {
+                __atomic_store_n(&job->bad_leaf, leaf, __ATOMIC_RELEASE);
+            }
+            pthread_mutex_unlock(&job->mutex);
+            break;
+        }
+    }
+
+    free(buffer);
+    return NULL;
+}
+
+// returns 0 if every leaf matches, 1 on a mismatch, -1 if it couldn't check
+int verify_file(const char *filename, const char *index_path, int num_threads) {
+    IndexHeader h;
+    uint64_t *expected = NULL;
+    if (load_index(index_path, &h, &expected) != 0) {
+        printf("%s: Error: '%s' is missing, or not an index for this digest mode\n",
+               filename, index_path);
+        return -1;
+    }
+
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        printf("%s: Error: Cannot open file\n", filename);
+        free(expected);
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        printf("%s: Error: Cannot stat file\n", filename);
+        free(expected);
+        close(fd);
+        return -1;
+    }
+
+    // a size change is a mismatch without reading anything
+    uint64_t file_size = st.st_size;
+    if (file_size != h.file_size) {
+        uint64_t low = file_size < h.file_size ? file_size : h.file_size;
+        uint64_t high = file_size < h.file_size ? h.file_size : file_size;
+        printf("%s: MISMATCH: size is %llu bytes, expected %llu - bytes [%llu, %llu) differ\n",
+               filename, (unsigned long long)file_size, (unsigned long long)h.file_size,
+               (unsigned long long)low, (unsigned long long)high);
+        free(expected);
+        close(fd);
+        return 1;
+    }
+
+    VerifyJob job = {
+        .fd = fd,
+        .file_size = file_size,
+        .expected = expected,
+        .num_leaves = h.num_leaves,
+        .next_leaf = 0,
+        .cancelled = 0,
+        .read_error = 0,
+        .bad_leaf = h.num_leaves
+    };
+    pthread_mutex_init(&job.mutex, NULL);
+
+    pthread_t threads[num_threads];
+    for (int i = 0; i < num_threads; i++) {
+        pthread_create(&threads[i], NULL, verify_worker_thread, &job);
+    }
+
+    for (int i = 0; i < num_threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    pthread_mutex_destroy(&job.mutex);
+    free(expected);
+    close(fd);
+
+    // a mismatch beats a read error, though a read error stops everyone, so
+    // then there may be a lower bad leaf that never got checked
+    if (job.bad_leaf < h.num_leaves) {
+        uint64_t start = (uint64_t)job.bad_leaf * LEAF_SIZE;
+        uint64_t end = start + LEAF_SIZE < file_size ? start + LEAF_SIZE : file_size;
+        printf("%s: MISMATCH: bytes [%llu, %llu) (leaf %zu) don't match the index\n",
+               filename, (unsigned long long)start, (unsigned long long)end, job.bad_leaf);
+        return 1;
+    }
+
+    if (job.read_error) {
+        printf("%s: Error: Could not read entire file\n", filename);
+        return -1;
+    }
+
+    printf("%s: OK (%zu leaves match)\n", filename, h.num_leaves);
+    return 0;
+}
+
+// ========== multi-digest mode ==========
+// every selected checksum in one pass: each worker runs the fused engine over
+// its slice, and the slices' digests are merged in file order
+
+void* digest_worker_thread(void *arg) {
+    DigestWorker *w = (DigestWorker *)arg;
+
+    pin_worker(w->thread_id);
+    multi_digest_update(&w->result, w->data, w->size);
+
+    return NULL;
+}
+
+// the engine's byte sum is a plain loop - the hash_chunk kernel is the same
+// sum, so it runs that instead. called from main before any worker starts
+MultiDigestKernels digest_kernels;
+
+void use_hash_kernel_for_digests(void) {
+    digest_kernels = multi_digest_portable_kernels;
+    digest_kernels.sum = hash_kernel;
+    multi_digest_kernels = &digest_kernels;
+}
+
+// returns 0 and fills `out`, or -1 if the file couldn't be loaded
+int hash_file_multi_digest(const char *filename, int num_threads, unsigned selected,
+                           MultiDigest *out) {
+    FileBuffer fb;
+    if (load_file(filename, &fb) != 0) {
+        return -1;
+    }
+
+    // same leaf-aligned slices as hash_file_multi_threaded
+    size_t leaves_per_thread = (leaf_count(fb.size) + num_threads - 1) / num_threads;
+    size_t slice_size = leaves_per_thread * LEAF_SIZE;
+
+    DigestWorker workers[num_threads];
+    pthread_t threads[num_threads];
+
+    for (int i = 0; i < num_threads; i++) {
+        size_t start = slice_size * i;
+        size_t size = 0;
+        if (start < fb.size) {
+            size = fb.size - start < slice_size ? fb.size - start : slice_size;
+        }
+
+        workers[i].data = fb.data + (start < fb.size ? start : fb.size);
+        workers[i].size = size;
+        workers[i].thread_id = i;
+        multi_digest_init(&workers[i].result, selected);
+        pthread_create(&threads[i], NULL, digest_worker_thread, &workers[i]);
+    }
+
+    for (int i = 0; i < num_threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    *out = workers[0].result;
+    for (int i = 1; i < num_threads; i++) {
+        multi_digest_combine(out, &workers[i].result, workers[i].size);
+    }
+
+    release_file(&fb);
+
+    return 0;
+}
+
+// parses a --digests= list - returns 0 on an unknown name
+unsigned parse_digests(char *list) {
+    unsigned selected = 0;
+
+    for (char *name = strtok(list, ","); name != NULL; name = strtok(NULL, ",")) {
+        if (strcmp(name, "sum") == 0) {
+            selected |= DIGEST_SUM;
+        } else if (strcmp(name, "simple") == 0) {
+            selected |= DIGEST_SIMPLE;
+        } else if (strcmp(name, "xor") == 0) {
+            selected |= DIGEST_XOR;
+        } else if (strcmp(name, "fletcher16") == 0) {
+            selected |= DIGEST_FLETCHER16;
+        } else if (strcmp(name, "crc32") == 0) {
+            selected |= DIGEST_CRC32;
+        } else if (strcmp(name, "all") == 0) {
+            selected |= DIGEST_ALL;
+        } else {
+            printf("Error: Unknown digest '%s'\n", name);
+            return 0;
+        }
+    }
+
+    return selected;
+}
+
+void print_multi_digest(const char *filename, const MultiDigest *md) {
+    printf("%s:", filename);
+    if (md->selected & DIGEST_SUM) {
+        printf(" sum=%llu", (unsigned long long)md->sum);
+    }
+    if (md->selected & DIGEST_SIMPLE) {
+        printf(" simple=%u", multi_digest_simple(md));
+    }
+    if (md->selected & DIGEST_XOR) {
+        printf(" xor=%u", md->xor_value);
+    }
+    if (md->selected & DIGEST_FLETCHER16) {
+        printf(" fletcher16=%u", multi_digest_fletcher16(md));
+    }
+    if (md->selected & DIGEST_CRC32) {
+        printf(" crc32=%08x", multi_digest_crc32(md));
+    }
+    printf("\n");
+}
+
+// ========== content-defined chunking ==========
+// cuts files where the content says, not at fixed offsets, so an insert near
+// the start of a file only changes the chunks around it. every chunk is
+// hashed and counted in a dedup index shared by all files of the run.
+//
+// the gear hash is h = (h << 1) + gear[byte], so after 64 bytes a byte has
+// shifted out completely - h at any position depends only on the 64 bytes
+// ending there. that makes the boundary scan parallel: each thread starts 63
+// bytes early and finds exactly the candidates a single pass would. picking
+// the actual cuts (min/max chunk size) is then a quick sequential walk.
+
+uint64_t gear_table[256];
+
+// fixed pseudo-random table (splitmix64), so cut points never change between
+// runs or machines
+void init_gear_table(void) {
+    uint64_t x = 0x6765617268617368ULL; // ... "gearhash"
+    for (int i = 0; i < 256; i++) {
+        x += 0x9E3779B97F4A7C15ULL;
+        uint64_t z = x;
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        gear_table[i] = z ^ (z >> 31);
+    }
+}
+
+void* cdc_scan_thread(void *arg) {
+    CdcScanWorker *w = (CdcScanWorker *)arg;
+
+    uint64_t pos = w->start >= 63 ? w->start - 63 : 0;
+    uint64_t h = 0;
+
+    // warm up on the bytes before our range - their candidates are someone else's
+    for (; pos < w->start; pos++) {
+        h = (h << 1) + gear_table[w->data[pos - w->base]];
+    }
+
+    for (; pos < w->end; pos++) {
+        h = (h << 1) + gear_table[w->data[pos - w->base]];
+        if ((h & w->mask) != 0) {
+            continue;
+        }
+
+        if (w->count == w->capacity) {
+            size_t capacity = w->capacity > 0 ? w->capacity * 2 : 1024;
+            uint64_t *grown = realloc(w->candidates, capacity * sizeof(uint64_t));
+            if (grown == NULL) {
+                w->failed = 1;
+                return NULL;
+            }
+            w->candidates = grown;
+            w->capacity = capacity;
+        }
+        w->candidates[w->count++] = pos + 1;
+    }
+
+    return NULL;
+}
+
+void* cdc_hash_thread(void *arg) {
+    CdcHashWorker *w = (CdcHashWorker *)arg;
+
+    for (size_t i = w->first; i < w->last; i++) {
+        w->digests[i] = xxh64(w->data + (w->cuts[i] - w->base), w->cuts[i + 1] - w->cuts[i],
+                              CDC_CHUNK_SEED);
+    }
+
+    return NULL;
+}
+
+DedupIndex* create_dedup_index(void) {
+    DedupIndex *index = calloc(1, sizeof(DedupIndex));
+    if (index == NULL) {
+        return NULL;
+    }
+
+    index->capacity = 1 << 16;
+    index->entries = calloc(index->capacity, sizeof(DedupEntry));
+    if (index->entries == NULL) {
+        free(index);
+        return NULL;
+    }
+
+    return index;
+}
+
+void destroy_dedup_index(DedupIndex *index) {
+    free(index->entries);
+    free(index);
+}
+
+// slot for (digest, size) - either where it is, or the empty slot it goes in
+DedupEntry* dedup_slot(DedupEntry *entries, size_t capacity, uint64_t digest, uint64_t size) {
+    size_t i = digest & (capacity - 1);
+    while (entries[i].size != 0 &&
+           (entries[i].digest != digest || entries[i].size != size)) {
+        i = (i + 1) & (capacity - 1);
+    }
+    return &entries[i];
+}
+
+// counts one chunk - returns 1 if it hadn't been seen before, -1 if out of memory
+int dedup_insert(DedupIndex *index, uint64_t digest, uint64_t size) {
+    // keep the table at most 70% full so probes stay short
+    if ((index->count + 1) * 10 > index->capacity * 7) {
+        size_t capacity = index->capacity * 2;
+        DedupEntry *entries = calloc(capacity, sizeof(DedupEntry));
+        if (entries == NULL) {
+            return -1;
+        }
+        for (size_t i = 0; i < index->capacity; i++) {
+            if (index->entries[i].size != 0) {
+                DedupEntry *e = &index->entries[i];
+                *dedup_slot(entries, capacity, e->digest, e->size) = *e;
+            }
+        }
+        free(index->entries);
+        index->entries = entries;
+        index->capacity = capacity;
+    }
+
+    index->total_bytes += size;
+    index->total_chunks++;
+
+    DedupEntry *slot = dedup_slot(index->entries, index->capacity, digest, size);
+    if (slot->size != 0) {
+        slot->refs++;
+        return 0;
+    }
+
+    slot->digest = digest;
+    slot->size = size;
+    slot->refs = 1;
+    index->count++;
+    index->unique_bytes += size;
+    return 1;
+}
+
+// chunks one file and adds every chunk to the index - returns the number of
+// chunks, or -1 on error
+long long cdc_file(const char *filename, int num_threads, size_t avg, DedupIndex *index) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        printf("Error: Cannot open file\n");
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        printf("Error: Cannot stat file\n");
+        close(fd);
+        return -1;
+    }
+    uint64_t file_size = st.st_size;
+
+    uint64_t min_size = avg / 4;
+    uint64_t max_size = avg * 4;
+
+    // the buffer holds the file from `base` to the end of the current window.
+    // base is the start of the unfinished chunk carried over from the last
+    // window (under max_size), or 63 bytes before the window for the gear
+    // warm-up, whichever is earlier - max_size is at least 256, so a window
+    // plus max_size always fits
+    size_t buffer_size = CDC_WINDOW_SIZE + max_size;
+    uint8_t *buffer = malloc(buffer_size);
+    uint64_t base = 0;
+    uint64_t buffered_end = 0; // ... buffer holds [base, buffered_end)
+
+    CdcScanWorker scans[num_threads];
+    memset(scans, 0, sizeof(scans));
+
+    // cut positions of one window, plus where the current chunk started. the
+    // chunk carried in from the last window is under max_size, and cuts are
+    // at least min_size apart (bar the end of the file)
+    size_t max_cuts = (CDC_WINDOW_SIZE + max_size) / min_size + 2;
+    uint64_t *cuts = malloc(max_cuts * sizeof(uint64_t));
+    uint64_t *digests = malloc(max_cuts * sizeof(uint64_t));
+    if (buffer == NULL || cuts == NULL || digests == NULL) {
+        printf("Error: out of memory\n");
+        free(buffer);
+        free(cuts);
+        free(digests);
+        close(fd);
+        return -1;
+    }
+
+    long long chunks = 0;
+    int failed = 0;
+    uint64_t last_cut = 0;
+
+    for (uint64_t window = 0; window < file_size && !failed; window += CDC_WINDOW_SIZE) {
+        uint64_t window_end = window + CDC_WINDOW_SIZE < file_size ? window + CDC_WINDOW_SIZE : file_size;
+        pthread_t threads[num_threads];
+
+        // 0. keep the bytes still needed from the last window, read the new one after them
+        double read_start = now_seconds();
+        uint64_t new_base = window >= 63 ? window - 63 : 0;
+        if (last_cut < new_base) {
+            new_base = last_cut;
+        }
+        memmove(buffer, buffer + (new_base - base), buffered_end - new_base);
+        base = new_base;
+        size_t length = window_end - window;
+        if (pread_full(fd, buffer + (window - base), length, window) != (ssize_t)length) {
+            printf("Error: Could not read entire file\n");
+            failed = 1;
+            break;
+        }
+        buffered_end = window_end;
+        profile_span("read", read_start, now_seconds());
+
+        // 1. find every candidate in the window, a slice per thread
+        double scan_start = now_seconds();
+        for (int i = 0; i < num_threads; i++) {
+            scans[i].data = buffer;
+            scans[i].base = base;
+            scans[i].start = window + (window_end - window) * i / num_threads;
+            scans[i].end = window + (window_end - window) * (i + 1) / num_threads;
+            scans[i].mask = avg - 1;
+            scans[i].count = 0;
+            pthread_create(&threads[i], NULL, cdc_scan_thread, &scans[i]);
+        }
+        for (int i = 0; i < num_threads; i++) {
+            pthread_join(threads[i], NULL);
+            failed |= scans[i].failed;
+        }
+        profile_span("scan", scan_start, now_seconds());
+        if (failed) {
+            printf("Error: out of memory\n");
+            break;
+        }
+
+        // 2. pick the cuts in order - skip candidates too close to the last
+        // cut, and force one where a chunk would grow past max_size
+        size_t num_cuts = 0;
+        cuts[num_cuts++] = last_cut;
+        for (int i = 0; i < num_threads; i++) {
+            for (size_t c = 0; c < scans[i].count; c++) {
+                uint64_t candidate = scans[i].candidates[c];
+                while (candidate - last_cut > max_size) {
+                    last_cut += max_size;
+                    cuts[num_cuts++] = last_cut;
+                }
+                if (candidate - last_cut >= min_size) {
+                    last_cut = candidate;
+                    cuts[num_cuts++] = last_cut;
+                }
+            }
+        }
+        while (window_end - last_cut >= max_size) {
+            last_cut += max_size;
+            cuts[num_cuts++] = last_cut;
+        }
+
+        // the end of the file ends the last chunk, whatever its size
+        if (window_end == file_size && last_cut < file_size) {
+            last_cut = file_size;
+            cuts[num_cuts++] = last_cut;
+        }
+
+        // 3. hash the finished chunks in parallel, then count them
+        size_t num_chunks = num_cuts - 1;
+        CdcHashWorker hashers[num_threads];
+        double hash_start = now_seconds();
+        for (int i = 0; i < num_threads; i++) {
+            hashers[i].data = buffer;
+            hashers[i].base = base;
+            hashers[i].cuts = cuts;
+            hashers[i].first = num_chunks * i / num_threads;
+            hashers[i].last = num_chunks * (i + 1) / num_threads;
+            hashers[i].digests = digests;
+            pthread_create(&threads[i], NULL, cdc_hash_thread, &hashers[i]);
+        }
+        for (int i = 0; i < num_threads; i++) {
+            pthread_join(threads[i], NULL);
+        }
+        profile_span("hash", hash_start, now_seconds());
+
+        for (size_t i = 0; i < num_chunks; i++) {
+            if (dedup_insert(index, digests[i], cuts[i + 1] - cuts[i]) < 0) {
+                printf("Error: out of memory\n");
+                failed = 1;
+                break;
+            }
+        }
+        chunks += num_chunks;
+    }
+
+    for (int i = 0; i < num_threads; i++) {
+        free(scans[i].candidates);
+    }
+    free(buffer);
+    free(cuts);
+    free(digests);
+    close(fd);
+
+    return failed ? -1 : chunks;
+}
+
+int run_cdc(const char **files, int num_files, int num_threads, size_t avg) {
+    if (avg < 64 || (avg & (avg - 1)) != 0) {
+        printf("Error: --cdc-avg must be a power of two of at least 64\n");
+        return 1;
+    }
+
+    init_gear_table();
+
+    DedupIndex *index = create_dedup_index();
+    if (index == NULL) {
+        printf("Error: out of memory\n");
+        return 1;
+    }
+
+    double start = now_seconds();
+    int status = 0;
+
+    for (int i = 0; i < num_files; i++) {
+        uint64_t bytes_before = index->total_bytes;
+        long long chunks = cdc_file(files[i], num_threads, avg, index);
+        if (chunks < 0) {
+            status = 1;
+            continue;
+        }
+
+        uint64_t bytes = index->total_bytes - bytes_before;
+        printf("%s: %lld chunks, %.0f bytes on average\n", files[i], chunks,
+               chunks > 0 ? (double)bytes / chunks : 0.0);
+    }
+
+    double elapsed = now_seconds() - start;
+
+    printf("\nChunk sizes: min %zu, target average %zu, max %zu\n", avg / 4, avg, avg * 4);
+    printf("Total:  %llu bytes in %llu chunks\n",
+           (unsigned long long)index->total_bytes, (unsigned long long)index->total_chunks);
+    printf("Unique: %llu bytes in %zu chunks\n",
+           (unsigned long long)index->unique_bytes, index->count);
+    printf("Dedup ratio: %.3f (%.1f%% of the data is duplicate)\n",
+           index->unique_bytes > 0 ? (double)index->total_bytes / index->unique_bytes : 1.0,
+           index->total_bytes > 0 ?
+               100.0 * (index->total_bytes - index->unique_bytes) / index->total_bytes : 0.0);
+    printf("Time: %.3f seconds (%.2f GB/s)\n", elapsed,
+           elapsed > 0 ? index->total_bytes / elapsed / 1e9 : 0.0);
+
+    destroy_dedup_index(index);
+    return status;
+}
+
+// ========== benchmark mode ==========
+// wall-clock sweep over file sizes and thread counts, with the page cache
+// warm (file read once beforehand) and cold (dropped before every run)
+
+// writes `size` bytes of xorshift noise into the scratch file on fd (which
+// it takes over and closes)
+int make_bench_file(int fd, const char *path, size_t size) {
+    FILE *fp = fdopen(fd, "wb");
+    if (fp == NULL) {
+        printf("Error: Cannot create '%s'\n", path);
+        close(fd);
+        return -1;
+    }
+
+    uint64_t *block = malloc(LEAF_SIZE);
+    if (block == NULL) {
+        fclose(fp);
+        return -1;
+    }
+
+    uint64_t x = 0x9E3779B97F4A7C15ULL;
+    size_t written = 0;
+    while (written < size) {
+        for (size_t i = 0; i < LEAF_SIZE / sizeof(uint64_t); i++) {
+            x ^= x << 13;
+            x ^= x >> 7;
+            x ^= x << 17;
+            block[i] = x;
+        }
+
+        size_t n = size - written < LEAF_SIZE ? size - written : LEAF_SIZE;
+        if (fwrite(block, 1, n, fp) != n) {
+            printf("Error: Cannot write '%s'\n", path);
+            free(block);
+            fclose(fp);
+            return -1;
+        }
+        written += n;
+    }
+
+    free(block);
+    return fclose(fp) == 0 ? 0 : -1;
+}
+
+// a file of `size` zero bytes that takes no disk space - reads of a hole
+// never touch the disk, so this measures the hashing side of very big files.
+// all zeros hash to 0, which the sweep treats as a failed run, so the last
+// byte is set (one page on disk)
+int make_sparse_file(int fd, const char *path, size_t size) {
+    uint8_t last = 1;
+    if (ftruncate(fd, size) != 0 ||
+        (size > 0 && pwrite(fd, &last, 1, size - 1) != 1)) {
+        printf("Error: Cannot extend '%s' to %zu bytes\n", path, size);
+        close(fd);
+        return -1;
+    }
+
+    close(fd);
+    return 0;
+}
+
+// fraction of the file's pages in the page cache right now (mincore on a
+// mapping that is never touched, so asking doesn't fault anything in)
+double cache_residency(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t pages = (st.st_size + page - 1) / page;
+    double fraction = 0;
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    unsigned char *vec = malloc(pages);
+    if (map != MAP_FAILED && vec != NULL && mincore(map, st.st_size, vec) == 0) {
+        size_t resident = 0;
+        for (size_t i = 0; i < pages; i++) {
+            resident += vec[i] & 1;
+        }
+        fraction = (double)resident / pages;
+    }
+
+    free(vec);
+    if (map != MAP_FAILED) {
+        munmap(map, st.st_size);
+    }
+    close(fd);
+
+    return fraction;
+}
+
+const char* cache_mode_name(CacheMode mode) {
+    return mode == CACHE_DIRECT ? "direct" : mode == CACHE_DROP ? "drop" : "keep";
+}
+
+void write_bench_csv(const char *path, const BenchResult *results, int count) {
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL) {
+        printf("Error: Cannot write '%s'\n", path);
+        return;
+    }
+
+    fprintf(fp, "size_bytes,read,threads,cache,status,seconds,gb_per_s,speedup,efficiency,resident,digest_ok\n");
+    for (int i = 0; i < count; i++) {
+        fprintf(fp, "%zu,%s,%d,%s,%s,%.6f,%.3f,%.3f,%.3f,%.3f,%d\n", results[i].size,
+                cache_mode_name(results[i].cache_mode), results[i].threads,
+                results[i].cold ? "cold" : "warm", results[i].failed ? "failed" : "ok",
+                results[i].seconds, results[i].gbps, results[i].speedup, results[i].efficiency,
+                results[i].resident, results[i].digest_ok);
+    }
+
+    fclose(fp);
+}
+
+void write_bench_json(const char *path, const BenchResult *results, int count) {
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL) {
+        printf("Error: Cannot write '%s'\n", path);
+        return;
+    }
+
+    fprintf(fp, "[\n");
+    for (int i = 0; i < count; i++) {
+        fprintf(fp, "  {\"size_bytes\": %zu, \"read\": \"%s\", \"threads\": %d, "
+                "\"cache\": \"%s\", \"status\": \"%s\", \"seconds\": %.6f, \"gb_per_s\": %.3f, "
+                "\"speedup\": %.3f, \"efficiency\": %.3f, \"resident\": %.3f, "
+                "\"digest_ok\": %s}%s\n",
+                results[i].size, cache_mode_name(results[i].cache_mode), results[i].threads,
+                results[i].cold ? "cold" : "warm", results[i].failed ? "failed" : "ok",
+                results[i].seconds, results[i].gbps, results[i].speedup, results[i].efficiency,
+                results[i].resident, results[i].digest_ok ? "true" : "false",
+                i + 1 < count ? "," : "");
+    }
+    fprintf(fp, "]\n");
+
+    fclose(fp);
+}
+
+// with --drop-cache or --direct the sweep runs twice, once through the page
+// cache and once bypassing it, so the two can be compared side by side
+int run_benchmark(const BenchOptions *opt) {
+    CacheMode modes[2] = { CACHE_KEEP, config.cache_mode };
+    int num_modes = config.cache_mode == CACHE_KEEP ? 1 : 2;
+
+    int per_size = num_modes * 2 * opt->max_threads;
+    BenchResult *results = calloc(opt->num_sizes * per_size, sizeof(BenchResult));
+    if (results == NULL) {
+        printf("Error: out of memory\n");
+        return 1;
+    }
+
+    int saved_verbose = config.verbose;
+    CacheMode saved_cache_mode = config.cache_mode;
+    config.verbose = 0;
+
+    printf("\n%12s %6s %8s %6s %10s %8s %8s %10s %9s\n", "size", "read", "threads",
+           "cache", "seconds", "GB/s", "speedup", "efficiency", "resident");
+
+    int count = 0;
+    int failed = 0;
+    for (int s = 0; s < opt->num_sizes && !failed; s++) {
+        // a fresh name every time (mkstemp opens with O_EXCL), so a file
+        // that is already in --bench-dir is never overwritten or deleted
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/bench_%s%zu_XXXXXX", opt->dir,
+                 opt->sparse ? "sparse_" : "", opt->sizes[s]);
+        int fd = mkstemp(path);
+        if (fd < 0) {
+            printf("Error: Cannot create a scratch file in '%s'\n", opt->dir);
+            failed = 1;
+            break;
+        }
+
+        int made = opt->sparse ? make_sparse_file(fd, path, opt->sizes[s])
+                               : make_bench_file(fd, path, opt->sizes[s]);
+        if (made != 0) {
+            unlink(path);
+            failed = 1;
+            break;
+        }
+
+        // every run of this size must agree with the first one
+        int have_digest = 0;
+        uint64_t size_digest = 0;
+
+        for (int m = 0; m < num_modes; m++) {
+            for (int cold = 0; cold <= 1; cold++) {
+                double base_seconds = 0;
+
+                for (int t = 1; t <= opt->max_threads; t++) {
+                    double best = 0;
+                    uint64_t digest = 0;
+                    int run_failed = 0;
+
+                    for (int r = 0; r < opt->repeats; r++) {
+                        if (cold) {
+                            drop_file_cache(path);
+                        } else if (r == 0 && t == 1) {
+                            // one untimed pass through the cache so the first
+                            // warm run isn't cold
+                            config.cache_mode = CACHE_KEEP;
+                            hash_file_multi_threaded(path, 1);
+                        }
+
+                        config.cache_mode = modes[m];
+                        double start = now_seconds();
+                        if (opt->use_stream) {
+                            digest = hash_file_streaming(path, t);
+                        } else {
+                            digest = hash_file_multi_threaded(path, t);
+                        }
+                        double elapsed = now_seconds() - start;
+
+                        // a digest of 0 means the hasher gave up - its time means nothing
+                        if (digest == 0) {
+                            run_failed = 1;
+                            break;
+                        }
+                        if (r == 0 || elapsed < best) {
+                            best = elapsed;
+                        }
+                    }
+
+                    if (t == 1) {
+                        base_seconds = run_failed ? 0 : best;
+                    }
+                    if (!have_digest && !run_failed) {
+                        size_digest = digest;
+                        have_digest = 1;
+                    }
+
+                    BenchResult *res = &results[count++];
+                    res->size = opt->sizes[s];
+                    res->threads = t;
+                    res->cold = cold;
+                    res->cache_mode = modes[m];
+                    res->failed = run_failed;
+                    res->resident = cache_residency(path);
+
+                    if (run_failed) {
+                        // no time, no speedup - and it fails the whole sweep
+                        res->digest_ok = 0;
+                        printf("%12zu %6s %8d %6s %10s\n", res->size, cache_mode_name(modes[m]),
+                               t, cold ? "cold" : "warm", "FAILED");
+                        continue;
+                    }
+
+                    res->seconds = best;
+                    res->gbps = opt->sizes[s] / best / 1e9;
+                    // against a failed 1 thread run there is nothing to compare to
+                    res->speedup = base_seconds > 0 ? base_seconds / best : 0;
+                    res->efficiency = res->speedup / t;
+                    res->digest_ok = (digest == size_digest);
+
+                    printf("%12zu %6s %8d %6s %10.4f %8.2f %8.2f %9.0f%% %8.0f%%%s\n",
+                           res->size, cache_mode_name(modes[m]), t, cold ? "cold" : "warm",
+                           res->seconds, res->gbps, res->speedup, res->efficiency * 100,
+                           res->resident * 100, res->digest_ok ? "" : "  DIGEST MISMATCH");
+                }
+            }
+        }
+
+        unlink(path);
+    }
+
+    config.verbose = saved_verbose;
+    config.cache_mode = saved_cache_mode;
+
+    if (opt->csv_path != NULL) {
+        write_bench_csv(opt->csv_path, results, count);
+    }
+    if (opt->json_path != NULL) {
+        write_bench_json(opt->json_path, results, count);
+    }
+
+    for (int i = 0; i < count; i++) {
+        failed |= !results[i].digest_ok;
+    }
+
+    free(results);
+    return failed ? 1 : 0;
+}
+
+// parses a byte count with an optional K, M or G suffix - returns 0 if invalid
+size_t parse_size(const char *text) {
+    char *end;
+    unsigned long long value = strtoull(text, &end, 10);
+
+    if (end == text) {
+        return 0;
+    }
+
+    if (*end == 'K' || *end == 'k') {
+        value *= 1024ULL;
+        end++;
+    } else if (*end == 'M' || *end == 'm') {
+        value *= 1024ULL * 1024;
+        end++;
+    } else if (*end == 'G' || *end == 'g') {
+        value *= 1024ULL * 1024 * 1024;
+        end++;
+    }
+
+    if (*end != '\0') {
+        return 0;
+    }
+
+    return (size_t)value;
+}
+
+void print_usage(const char *program) {
+    printf("Usage: %s [options] [file...]\n", program);
+    printf("  --tree          order-sensitive Merkle tree digest instead of the byte sum\n");
+    printf("  --compare       time sum and tree digests, single vs multi-threaded\n");
+    printf("  --uring         read with io_uring, many reads in flight (falls back\n");
+    printf("                  to read() if the kernel doesn't allow it)\n");
+    printf("  --mmap          hash straight out of a memory mapping (no copy)\n");
+    printf("  --stream        multi-threaded run reads the file in a pipeline of\n");
+    printf("                  fixed-size blocks instead of loading it all\n");
+    printf("  --drop-cache    posix_fadvise(DONTNEED) what has been read, so hashing\n");
+    printf("                  big files doesn't evict everything else from the cache\n");
+    printf("  --direct        read with O_DIRECT into aligned blocks (implies --stream)\n");
+    printf("  --pin           pin each worker thread to its own CPU\n");
+    printf("  --first-touch   each worker reads its own slice of the file, so the\n");
+    printf("                  memory is placed on its NUMA node (use with --pin)\n");
+    printf("  --huge-pages=P  back big buffers with huge pages: thp (madvise) or\n");
+    printf("                  hugetlb (reserved pool, falls back to thp)\n");
+    printf("  --sparse        multi-threaded run skips holes (SEEK_DATA/SEEK_HOLE)\n");
+    printf("                  and only reads leaves that hold data\n");
+    printf("  --steal         split into small chunks scheduled with work stealing\n");
+    printf("  --chunk-size=S  chunk size for --steal, e.g. 1M (default 2M)\n");
+    printf("  --dir           treat each argument as a directory and hash every file\n");
+    printf("                  under it (--mmap recommended for big files)\n");
+    printf("  --manifest=F    directory mode: write the manifest to F, not stdout\n");
+    printf("  --cache         incremental: keep leaf digests in <file>%s. an untouched\n", INDEX_SUFFIX);
+    printf("                  file is not read; a file that only grew is taken as\n");
+    printf("                  appended to and only its new tail is read; any other\n");
+    printf("                  change re-reads the whole file unless --dirty is given\n");
+    printf("  --dirty=O:L     with --cache, bytes [O, O+L) were written since the last\n");
+    printf("                  run (repeatable). if the file changed, only these (and\n");
+    printf("                  anything past the old end) are re-read - the rest is\n");
+    printf("                  trusted, so list every write\n");
+    printf("  --bench         benchmark: sweep 1..--threads threads over generated files,\n");
+    printf("                  warm and cold cache, wall-clock GB/s/speedup/efficiency\n");
+    printf("  --bench-sizes=L comma-separated file sizes (default 64M,256M)\n");
+    printf("  --bench-dir=D   where the test files are generated (default .)\n");
+    printf("  --bench-sparse  benchmark on sparse files, e.g. --bench-sizes=8G,64G\n");
+    printf("                  (pair big sizes with --stream or --mmap)\n");
+    printf("  --csv=F         benchmark: also write the table as CSV\n");
+    printf("  --json=F        benchmark: also write the table as JSON\n");
+    printf("  --verify        check each file against its %s index from a --cache\n", INDEX_SUFFIX);
+    printf("                  run, and report the first leaf that doesn't match\n");
+    printf("  --verify=I      same, but against index file I (one file only)\n");
+    printf("  --digests=L     compute the listed checksums in one fused pass:\n");
+    printf("                  sum, simple, xor, fletcher16, crc32 or all\n");
+    printf("  --profile       time each stage of the multi-threaded run and print\n");
+    printf("                  per-worker bytes, busy and idle time\n");
+    printf("  --trace=F       --profile, and write a Chrome trace-event JSON to F\n");
+    printf("  --cdc           split files into content-defined chunks and report how\n");
+    printf("                  much of the data is duplicate across all of them\n");
+    printf("  --cdc-avg=S     --cdc target chunk size, a power of two (default 8K)\n");
+    printf("  --pool          hash every file through one persistent thread pool\n");
+    printf("  --kernel=K      force a hash_chunk kernel: scalar, sse2, avx2, avx512\n");
+    printf("  --quiet         no per-thread progress messages\n");
+    printf("  --threads=N     threads for the multi-threaded run (default 3)\n");
+    printf("  file            input file(s) (default test_file.bin), - for stdin\n");
+}
+
+int main(int argc, char *argv[]) {
+    const char *filename = "test_file.bin";
+    int num_threads = 3;
+    int threads_given = 0;
+    int use_bench = 0;
+    BenchOptions bench = {
+        .dir = ".",
+        .sizes = { 64 * 1024 * 1024, 256 * 1024 * 1024 },
+        .num_sizes = 2,
+        .repeats = BENCH_REPEATS
+    };
+    int use_stream = 0;
+    int use_pool = 0;
+    int compare = 0;
+    int use_dir = 0;
+    const char *manifest_path = NULL;
+    int use_cache = 0;
+    int use_verify = 0;
+    int use_cdc = 0;
+    int use_sparse = 0;
+    size_t cdc_avg = CDC_DEFAULT_AVG;
+    int use_profile = 0;
+    const char *trace_path = NULL;
+    unsigned digests = 0;
+    const char *verify_index = NULL;
+    DirtyRange dirty[MAX_DIRTY_RANGES];
+    int num_dirty = 0;
+
+    const char *kernel = NULL;
+
+    const char **files = malloc(argc * sizeof(char *));
+    int num_files = 0;
+    if (files == NULL) {
+        printf("Error: out of memory\n");
+        return 1;
+    }
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--mmap") == 0) {
+            config.input_mode = INPUT_MMAP;
+        } else if (strcmp(argv[i], "--uring") == 0) {
+            config.io_backend = IO_URING;
+        } else if (strcmp(argv[i], "--huge-pages=thp") == 0) {
+            config.page_mode = PAGES_THP;
+        } else if (strcmp(argv[i], "--huge-pages=hugetlb") == 0) {
+            config.page_mode = PAGES_HUGETLB;
+        } else if (strcmp(argv[i], "--pin") == 0) {
+            config.pin_threads = 1;
+        } else if (strcmp(argv[i], "--first-touch") == 0) {
+            config.first_touch = 1;
+        } else if (strcmp(argv[i], "--drop-cache") == 0) {
+            config.cache_mode = CACHE_DROP;
+        } else if (strcmp(argv[i], "--direct") == 0) {
+            // only the streaming engine has a block pool to read into
+            config.cache_mode = CACHE_DIRECT;
+            use_stream = 1;
+        } else if (strcmp(argv[i], "--stream") == 0) {
+            use_stream = 1;
+        } else if (strcmp(argv[i], "--tree") == 0) {
+            config.hash_mode = HASH_TREE;
+        } else if (strcmp(argv[i], "--compare") == 0) {
+            compare = 1;
+        } else if (strcmp(argv[i], "--dir") == 0) {
+            use_dir = 1;
+        } else if (strncmp(argv[i], "--manifest=", 11) == 0) {
+            manifest_path = argv[i] + 11;
+        } else if (strcmp(argv[i], "--cache") == 0) {
+            use_cache = 1;
+        } else if (strncmp(argv[i], "--dirty=", 8) == 0) {
+            // O:L - a plain offset, then a length that may have a K/M/G suffix
+            const char *text = argv[i] + 8;
+            char *end;
+            unsigned long long offset = strtoull(text, &end, 10);
+            if (text[0] < '0' || text[0] > '9' || *end != ':' || parse_size(end + 1) == 0 ||
+                num_dirty == MAX_DIRTY_RANGES) {
+                printf("Error: Invalid dirty range '%s'\n", text);
+                return 1;
+            }
+            dirty[num_dirty].offset = offset;
+            dirty[num_dirty].length = parse_size(end + 1);
+            num_dirty++;
+        } else if (strcmp(argv[i], "--bench") == 0) {
+            use_bench = 1;
+        } else if (strncmp(argv[i], "--bench-sizes=", 14) == 0) {
+            bench.num_sizes = 0;
+            for (char *item = strtok(argv[i] + 14, ","); item != NULL; item = strtok(NULL, ",")) {
+                if (bench.num_sizes == BENCH_MAX_SIZES || parse_size(item) == 0) {
+                    printf("Error: Invalid benchmark size '%s'\n", item);
+                    return 1;
+                }
+                bench.sizes[bench.num_sizes++] = parse_size(item);
+            }
+        } else if (strcmp(argv[i], "--bench-sparse") == 0) {
+            bench.sparse = 1;
+        } else if (strncmp(argv[i], "--bench-dir=", 12) == 0) {
+            bench.dir = argv[i] + 12;
+        } else if (strncmp(argv[i], "--csv=", 6) == 0) {
+            bench.csv_path = argv[i] + 6;
+        } else if (strncmp(argv[i], "--json=", 7) == 0) {
+            bench.json_path = argv[i] + 7;
+        } else if (strncmp(argv[i], "--digests=", 10) == 0) {
+            digests = parse_digests(argv[i] + 10);
+            if (digests == 0) {
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--profile") == 0) {
+            use_profile = 1;
+        } else if (strncmp(argv[i], "--trace=", 8) == 0) {
+            use_profile = 1;
+            trace_path = argv[i] + 8;
+        } else if (strcmp(argv[i], "--sparse") == 0) {
+            use_sparse = 1;
+        } else if (strcmp(argv[i], "--cdc") == 0) {
+            use_cdc = 1;
+        } else if (strncmp(argv[i], "--cdc-avg=", 10) == 0) {
+            use_cdc = 1;
+            cdc_avg = parse_size(argv[i] + 10);
+        } else if (strcmp(argv[i], "--verify") == 0) {
+            use_verify = 1;
+        } else if (strncmp(argv[i], "--verify=", 9) == 0) {
+            use_verify = 1;
+            verify_index = argv[i] + 9;
+        } else if (strcmp(argv[i], "--pool") == 0) {
+            use_pool = 1;
+        } else if (strncmp(argv[i], "--kernel=", 9) == 0) {
+            kernel = argv[i] + 9;
+        } else if (strcmp(argv[i], "--quiet") == 0) {
+            config.verbose = 0;
+        } else if (strcmp(argv[i], "--steal") == 0) {
+            config.work_stealing = 1;
+        } else if (strncmp(argv[i], "--chunk-size=", 13) == 0) {
+            config.chunk_size = parse_size(argv[i] + 13);
+            if (config.chunk_size == 0) {
+                printf("Error: Invalid chunk size '%s'\n", argv[i] + 13);
+                return 1;
+            }
+        } else if (strncmp(argv[i], "--threads=", 10) == 0) {
+            num_threads = atoi(argv[i] + 10);
+            threads_given = 1;
+        } else if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
+            print_usage(argv[0]);
+            return 0;
+        } else if (argv[i][0] == '-' && argv[i][1] != '\0') { // ... a lone - is stdin
+            printf("Error: Unknown option '%s'\n", argv[i]);
+            print_usage(argv[0]);
+            return 1;
+        } else {
+            files[num_files++] = argv[i];
+        }
+    }
+
+    if (num_threads < 1) {
+        printf("Error: Thread count must be at least 1\n");
+        return 1;
+    }
+
+    if (use_dir && num_files == 0) {
+        printf("Error: --dir needs at least one directory\n");
+        free(files);
+        return 1;
+    }
+
+    if (num_files == 0) {
+        files[num_files++] = filename;
+    }
+    filename = files[0];
+
+    // the plain single/multi-threaded run and --compare only hash one file -
+    // every other mode loops over all of them
+    if (num_files > 1 && !use_pool && !use_dir && !use_cdc && !use_verify && !use_cache &&
+        digests == 0 && !use_bench) {
+        printf("Error: Only one file can be hashed here - use --pool to hash several\n");
+        free(files);
+        return 1;
+    }
+
+    // pick the kernel up front rather than on the first hash_chunk call
+    pthread_once(&hash_kernel_once, select_hash_kernel);
+    if (kernel != NULL && set_hash_kernel(kernel) != 0) {
+        printf("Error: Kernel '%s' is not available on this CPU\n", kernel);
+        free(files);
+        return 1;
+    }
+
+    if (config.input_mode == INPUT_MMAP && config.cache_mode != CACHE_KEEP) {
+        printf("Error: --mmap hashes out of the page cache, it can't be combined with "
+               "--drop-cache or --direct\n");
+        free(files);
+        return 1;
+    }
+
+    printf("Input mode: %s%s\n", config.input_mode == INPUT_MMAP ? "mmap" :
+           config.io_backend == IO_URING ? "read (io_uring)" : "read",
+           config.cache_mode == CACHE_DIRECT ? ", O_DIRECT" :
+           config.cache_mode == CACHE_DROP ? ", dropping the cache" : "");
+    printf("Hash kernel: %s\n", hash_kernel_name);
+    printf("Digest: %s\n", config.hash_mode == HASH_TREE ? "tree" : "sum");
+
+    if (use_bench) {
+        // default to one thread per online CPU
+        bench.max_threads = threads_given ? num_threads : (int)sysconf(_SC_NPROCESSORS_ONLN);
+        if (bench.max_threads < 1) {
+            bench.max_threads = 1;
+        }
+        bench.use_stream = use_stream;
+        free(files);
+        return run_benchmark(&bench);
+    }
+
+    if (use_cdc) {
+        int result = run_cdc(files, num_files, num_threads, cdc_avg);
+        free(files);
+        return result;
+    }
+
+    if (digests != 0) {
+        use_hash_kernel_for_digests();
+        int status = 0;
+        for (int i = 0; i < num_files; i++) {
+            double start = now_seconds();
+            MultiDigest md;
+            if (hash_file_multi_digest(files[i], num_threads, digests, &md) != 0) {
+                status = 1;
+                continue;
+            }
+            print_multi_digest(files[i], &md);
+            printf("Time: %.3f seconds\n", now_seconds() - start);
+        }
+        free(files);
+        return status;
+    }
+
+    if (compare) {
+        int result = compare_hash_modes(filename, num_threads);
+        free(files);
+        return result;
+    }
+
+    if (use_dir) {
+        int result = run_dir_walk(files, num_files, num_threads, manifest_path);
+        free(files);
+        return result;
+    }
+
+    if (use_verify) {
+        if (verify_index != NULL && num_files > 1) {
+            printf("Error: --verify=I takes a single file\n");
+            free(files);
+            return 1;
+        }
+
+        int status = 0;
+        for (int i = 0; i < num_files; i++) {
+            char index_path[4096];
+            if (verify_index != NULL) {
+                snprintf(index_path, sizeof(index_path), "%s", verify_index);
+            } else {
+                snprintf(index_path, sizeof(index_path), "%s%s", files[i], INDEX_SUFFIX);
+            }
+
+            double start = now_seconds();
+            int result = verify_file(files[i], index_path, num_threads);
+            printf("Time: %.3f seconds\n", now_seconds() - start);
+            if (result != 0) {
+                status = 1;
+            }
+        }
+        free(files);
+        return status;
+    }
+
+    if (use_cache) {
+        int status = 0;
+        for (int i = 0; i < num_files; i++) {
+            double start = now_seconds();
+            uint64_t hash;
+            size_t rehashed;
+            if (hash_file_incremental(files[i], num_threads, dirty, num_dirty, &hash, &rehashed) != 0) {
+                status = 1;
+                continue;
+            }
+            printf("%s: %llu (re-hashed %zu leaves in %.3f seconds)\n", files[i],
+                   (unsigned long long)hash, rehashed, now_seconds() - start);
+        }
+        free(files);
+        return status;
+    }
+
+    if (use_pool) {
+        int result = run_pool(files, num_files, num_threads);
+        free(files);
+        return result;
+    }
+    free(files);
+
+    // standard input can only be read once, so there is no single-threaded
+    // run to compare against - just the streaming engine
+    int from_stdin = strcmp(filename, "-") == 0;
+
+    if (!from_stdin) {
+        double start = now_seconds();
+
+        uint64_t hash = hash_file_single_threaded(filename);
+
+        double time_spent = now_seconds() - start;
+
+        printf("Hash: %llu\n", hash);
+        printf("Time: %.3f seconds\n", time_spent);
+    }
+
+    // only the multi-threaded run is profiled
+    if (use_profile && start_profiler() != 0) {
+        return 1;
+    }
+
+    double start_parallel = now_seconds();
+
+    uint64_t hash_parallel;
+    if (from_stdin) {
+        hash_parallel = hash_fd_streaming(STDIN_FILENO, 0, num_threads);
+    } else if (use_sparse) {
+        hash_parallel = hash_file_sparse(filename, num_threads);
+    } else if (use_stream) {
+        hash_parallel = hash_file_streaming(filename, num_threads);
+    } else {
+        hash_parallel = hash_file_multi_threaded(filename, num_threads);
+    }
+
+    double time_spent_parallel = now_seconds() - start_parallel;
+
+    printf("Hash: %llu\n", hash_parallel);
+    printf("Time: %.3f seconds\n", time_spent_parallel);
+
+    if (use_profile) {
+        profiler.enabled = 0;
+        print_profile();
+        if (trace_path != NULL) {
+            write_trace(trace_path);
+        }
+        free(profiler.events);
+    }
+
+    return 0;
+}